@@ -412,6 +412,232 @@ static inline __attribute__((always_inline)) uint32_t convert_colour(struct flan
 #define convert_colour(CTX, COLOUR) (COLOUR)
 #endif
 
+#ifdef FLANTERM_FB_ENABLE_COMPACT_CELLS
+
+static inline bool colour_bit(uint64_t *bits, size_t i) {
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void mark_colours(uint64_t *live, uint32_t v) {
+    size_t fg = (v >> 8) & (FLANTERM_FB_COLOURS - 1);
+    size_t bg = v >> 20;
+    live[fg / 64] |= (uint64_t)1 << (fg % 64);
+    live[bg / 64] |= (uint64_t)1 << (bg % 64);
+}
+
+// Cells are overwritten without looking at what they held, so instead of
+// counting references the slots still in use are found by going through
+// every cell once the table fills up.
+static void collect_colours(struct flanterm_context *_ctx) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    uint64_t *live = ctx->colours_live;
+    memset(live, 0, sizeof(ctx->colours_live));
+    live[0] = 1;
+    mark_colours(live, ctx->text_colours);
+
+    for (size_t row = 0; row < _ctx->rows; row++) {
+        struct flanterm_fb_row_state *state = &ctx->row_state[row];
+        if (state->cleared) {
+            mark_colours(live, state->blank.v);
+        }
+        for (size_t x = 0; x < _ctx->cols; x++) {
+            size_t i = row * _ctx->cols + x;
+            mark_colours(live, ctx->grid[i].v);
+            if (colour_bit(&ctx->pending_bits[row * ctx->pending_words], x)) {
+                mark_colours(live, ctx->pending[i].v);
+            }
+        }
+    }
+
+    // A freed slot still has to be probed past unless the one after it
+    // ends the probe too. Going backwards twice covers runs that wrap.
+    uint64_t *used = ctx->colours_used;
+    for (size_t n = 2 * FLANTERM_FB_COLOURS; n-- > 0;) {
+        size_t i = n % FLANTERM_FB_COLOURS;
+        size_t next = (i + 1) % FLANTERM_FB_COLOURS;
+        if (!colour_bit(live, i) && !colour_bit(used, next)) {
+            used[i / 64] &= ~((uint64_t)1 << (i % 64));
+        }
+    }
+
+    ctx->colours_count = 0;
+    for (size_t i = 0; i < FLANTERM_FB_COLOURS / 64; i++) {
+        ctx->colours_count += __builtin_popcountll(live[i]);
+    }
+    size_t free_slots = FLANTERM_FB_COLOURS - ctx->colours_count;
+    ctx->colours_collect_at = ctx->colours_count + (free_slots > FLANTERM_FB_COLOURS / 8 ? free_slots / 2 : FLANTERM_FB_COLOURS / 16);
+}
+
+// Returns the slot holding colour, or SIZE_MAX if there is none. free_slot
+// is set to the first free slot on the way, or SIZE_MAX.
+static size_t probe_colour(struct flanterm_context *_ctx, uint32_t colour, size_t *free_slot) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    *free_slot = SIZE_MAX;
+    size_t i = ((uint32_t)(colour * 0x9e3779b1) >> 16) % FLANTERM_FB_COLOURS;
+    for (size_t n = 0; n < FLANTERM_FB_COLOURS; n++) {
+        if (colour_bit(ctx->colours_live, i)) {
+            if (ctx->colours[i] == colour) {
+                return i;
+            }
+        } else {
+            if (*free_slot == SIZE_MAX) {
+                *free_slot = i;
+            }
+            if (!colour_bit(ctx->colours_used, i)) {
+                break;
+            }
+        }
+        i = (i + 1) % FLANTERM_FB_COLOURS;
+    }
+    return SIZE_MAX;
+}
+
+// With every slot in use, a new colour is drawn as the closest one there is.
+static size_t closest_colour(struct flanterm_context *_ctx, uint32_t colour) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    size_t best = 0;
+    uint32_t best_distance = UINT32_MAX;
+    for (size_t i = 1; i < FLANTERM_FB_COLOURS; i++) {
+        uint32_t distance = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            int d = (int)((colour >> shift) & 0xff) - (int)((ctx->colours[i] >> shift) & 0xff);
+            distance += d < 0 ? -d : d;
+        }
+        if (distance < best_distance) {
+            best = i;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+static size_t find_colour(struct flanterm_context *_ctx, uint32_t colour) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (colour == 0xffffffff) {
+        return 0;
+    }
+
+    size_t free_slot;
+    size_t i = probe_colour(_ctx, colour, &free_slot);
+    if (i != SIZE_MAX) {
+        return i;
+    }
+
+    if (ctx->colours_count >= ctx->colours_collect_at) {
+        collect_colours(_ctx);
+        probe_colour(_ctx, colour, &free_slot);
+    }
+    if (free_slot == SIZE_MAX) {
+        // Every colour that has to be approximated brings the next
+        // collection closer, which may free some slots again.
+        ctx->colours_collect_at--;
+        return closest_colour(_ctx, colour);
+    }
+
+    ctx->colours[free_slot] = colour;
+    ctx->colours_live[free_slot / 64] |= (uint64_t)1 << (free_slot % 64);
+    ctx->colours_used[free_slot / 64] |= (uint64_t)1 << (free_slot % 64);
+    ctx->colours_count++;
+    return free_slot;
+}
+
+// Has to be called whenever text_fg or text_bg change. The foreground is
+// stored first so that a collection while finding the background keeps it.
+static void update_text_colours(struct flanterm_context *_ctx) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    ctx->text_colours = (ctx->text_colours & 0xfff00000) | find_colour(_ctx, ctx->text_fg) << 8;
+    ctx->text_colours = (ctx->text_colours & 0x000fff00) | find_colour(_ctx, ctx->text_bg) << 20;
+}
+
+static inline uint32_t char_glyph(struct flanterm_fb_char *c) {
+    return c->v & 0xff;
+}
+
+static inline uint32_t char_fg(struct flanterm_context *_ctx, struct flanterm_fb_char *c) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    return ctx->colours[(c->v >> 8) & (FLANTERM_FB_COLOURS - 1)];
+}
+
+static inline uint32_t char_bg(struct flanterm_context *_ctx, struct flanterm_fb_char *c) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    return ctx->colours[c->v >> 20];
+}
+
+static inline void make_char(struct flanterm_context *_ctx, struct flanterm_fb_char *c, uint8_t glyph) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    c->v = glyph | ctx->text_colours;
+}
+
+static inline bool compare_char(struct flanterm_fb_char *a, struct flanterm_fb_char *b) {
+    return a->v == b->v;
+}
+
+static inline bool compare_colours(struct flanterm_fb_char *a, struct flanterm_fb_char *b) {
+    return (a->v >> 8) == (b->v >> 8);
+}
+
+static inline bool compare_bg(struct flanterm_fb_char *a, struct flanterm_fb_char *b) {
+    return (a->v >> 20) == (b->v >> 20);
+}
+
+static inline void swap_colours(struct flanterm_fb_char *c) {
+    c->v = (c->v & 0xff) | ((c->v >> 8) & 0xfff) << 20 | (c->v >> 20) << 8;
+}
+
+#else
+
+#define update_text_colours(CTX)
+
+static inline uint32_t char_glyph(struct flanterm_fb_char *c) {
+    return c->c;
+}
+
+static inline uint32_t char_fg(struct flanterm_context *_ctx, struct flanterm_fb_char *c) {
+    (void)_ctx;
+    return c->fg;
+}
+
+static inline uint32_t char_bg(struct flanterm_context *_ctx, struct flanterm_fb_char *c) {
+    (void)_ctx;
+    return c->bg;
+}
+
+static inline void make_char(struct flanterm_context *_ctx, struct flanterm_fb_char *c, uint8_t glyph) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    c->c  = glyph;
+    c->fg = ctx->text_fg;
+    c->bg = ctx->text_bg;
+}
+
+static inline bool compare_char(struct flanterm_fb_char *a, struct flanterm_fb_char *b) {
+    return !(a->c != b->c || a->bg != b->bg || a->fg != b->fg);
+}
+
+static inline bool compare_colours(struct flanterm_fb_char *a, struct flanterm_fb_char *b) {
+    return a->bg == b->bg && a->fg == b->fg;
+}
+
+static inline bool compare_bg(struct flanterm_fb_char *a, struct flanterm_fb_char *b) {
+    return a->bg == b->bg;
+}
+
+static inline void swap_colours(struct flanterm_fb_char *c) {
+    uint32_t tmp = c->fg;
+    c->fg = c->bg;
+    c->bg = tmp;
+}
+
+#endif
+
 static void flanterm_fb_save_state(struct flanterm_context *_ctx) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
     ctx->saved_state_text_fg = ctx->text_fg;
@@ -426,6 +652,7 @@ static void flanterm_fb_restore_state(struct flanterm_context *_ctx) {
     ctx->text_bg = ctx->saved_state_text_bg;
     ctx->cursor_x = ctx->saved_state_cursor_x;
     ctx->cursor_y = ctx->saved_state_cursor_y;
+    update_text_colours(_ctx);
 }
 
 static void flanterm_fb_swap_palette(struct flanterm_context *_ctx) {
@@ -433,414 +660,1801 @@ static void flanterm_fb_swap_palette(struct flanterm_context *_ctx) {
     uint32_t tmp = ctx->text_bg;
     ctx->text_bg = ctx->text_fg;
     ctx->text_fg = tmp;
+    update_text_colours(_ctx);
 }
 
-static void plot_char(struct flanterm_context *_ctx, struct flanterm_fb_char *c, size_t x, size_t y) {
+// Glyph rows are the bytes of the font, most significant bit first. Columns
+// past the eighth one are blank, except for characters 0xC0-0xDF which
+// replicate the eighth column like VGA Line Graphics Mode does.
+static inline bool glyph_row_extra(uint32_t c, uint8_t bits) {
+    return c >= 0xc0 && c <= 0xdf && (bits & 1);
+}
+
+// Returns a table of the 4 pixels each nibble of a glyph row expands to in
+// fg and bg. The table of the last colour pair is kept, the context starting
+// out zeroed matches fg = bg = 0.
+static uint32_t (*nibble_lut(struct flanterm_context *_ctx, uint32_t fg, uint32_t bg))[4] {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    if (x >= _ctx->cols || y >= _ctx->rows) {
-        return;
+    if (ctx->nibble_lut_fg != fg || ctx->nibble_lut_bg != bg) {
+        for (size_t n = 0; n < 16; n++) {
+            for (size_t i = 0; i < 4; i++) {
+                ctx->nibble_lut[n][i] = (n & (8 >> i)) ? fg : bg;
+            }
+        }
+        ctx->nibble_lut_fg = fg;
+        ctx->nibble_lut_bg = bg;
     }
 
-#ifdef FLANTERM_FB_DISABLE_CANVAS
-    uint32_t default_bg = ctx->default_bg;
+    return ctx->nibble_lut;
+}
+
+// FLANTERM_FB_ENABLE_STAGING composes each pixel row of a span in memory
+// and stores it whole, which is meant for framebuffers that are uncached or
+// write-combining. On a framebuffer in ordinary cached memory it is slower:
+// tests/staging (make -C tests bench) measures about 5 to 25% more time per
+// cell at scales 1, 2 and 4, with or without the canvas, and no gain.
+#ifdef FLANTERM_FB_ENABLE_STAGING
+#if defined(__SSE2__)
+typedef long long staging_vector __attribute__((vector_size(16)));
 #endif
 
-    x = ctx->offset_x + x * ctx->glyph_width;
-    y = ctx->offset_y + y * ctx->glyph_height;
+static inline __attribute__((always_inline)) void copy_row(volatile uint32_t *dst, const uint32_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __builtin_memcpy((void *)(uintptr_t)(dst + i), src + i, 4 * sizeof(uint32_t));
+    }
+    for (; i < n; i++) {
+        dst[i] = src[i];
+    }
+}
+
+// Copies a row of pixels composed in the staging buffer to the framebuffer
+// 16 bytes at a time. Cache lines the row covers whole are written with
+// non-temporal stores on x86, which do not pull them into the cache;
+// store_fence() has to run before the framebuffer is expected to show
+// them. Partly covered lines are not, as a non-temporal store of part of a
+// line is slower than a normal one.
+static inline __attribute__((always_inline)) void store_row(volatile uint32_t *dst, const uint32_t *src, size_t n) {
+    size_t done = 0;
+
+#if defined(__SSE2__)
+    size_t head = (-(uintptr_t)dst & 63) / sizeof(uint32_t);
+    if (n >= head + 16) {
+        size_t end = head + ((n - head) & ~(size_t)15);
+        copy_row(dst, src, head);
+        for (size_t i = head; i < end; i += 4) {
+            staging_vector v;
+            __builtin_memcpy(&v, src + i, sizeof(v));
+            __builtin_ia32_movntdq((staging_vector *)(uintptr_t)(dst + i), v);
+        }
+        done = end;
+    }
+#endif
+
+    copy_row(dst + done, src + done, n - done);
+}
+
+static inline void store_fence(void) {
+#if defined(__SSE2__)
+    __builtin_ia32_sfence();
+#endif
+}
+#endif
+
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+// Records that cells x to x + count - 1 of screen row y were drawn to the
+// shadow framebuffer and have to be copied to the real one.
+static inline void mark_dirty(struct flanterm_context *_ctx, size_t x, size_t y, size_t count) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    struct flanterm_fb_dirty_span *span = &ctx->dirty[y];
+    if (x < span->start) {
+        span->start = x;
+    }
+    if (x + count > span->end) {
+        span->end = x + count;
+    }
+}
+
+// Copies what was drawn since the last call from the shadow framebuffer to
+// the real one, a pixel row of a span at a time.
+static void push_shadow(struct flanterm_context *_ctx) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    size_t stride = ctx->pitch / 4;
+    size_t front_stride = ctx->front_pitch / 4;
+
+    if (ctx->shadow_all_dirty) {
+        for (size_t y = 0; y < ctx->height; y++) {
+            memcpy((void *)(uintptr_t)(ctx->front_framebuffer + y * front_stride),
+                   (const void *)(uintptr_t)(ctx->framebuffer + y * stride),
+                   ctx->width * sizeof(uint32_t));
+        }
+        ctx->shadow_all_dirty = false;
+    }
+
+    for (size_t y = 0; y < _ctx->rows; y++) {
+        struct flanterm_fb_dirty_span *span = &ctx->dirty[y];
+        if (span->start >= span->end) {
+            continue;
+        }
+
+        size_t x = ctx->offset_x + span->start * ctx->glyph_width;
+        size_t line_size = (span->end - span->start) * ctx->glyph_width * sizeof(uint32_t);
+        size_t py = ctx->offset_y + y * ctx->glyph_height;
+        for (size_t gy = 0; gy < ctx->glyph_height; gy++) {
+            memcpy((void *)(uintptr_t)(ctx->front_framebuffer + x + (py + gy) * front_stride),
+                   (const void *)(uintptr_t)(ctx->framebuffer + x + (py + gy) * stride),
+                   line_size);
+        }
+
+        span->start = SIZE_MAX;
+        span->end = 0;
+    }
+}
+#endif
+
+// The plot_char_* kernels draw one cell at pixel position x, y. plot_char
+// picks the one for the cell, so that the per pixel work does not have to
+// care about transparent colours unless the cell has some.
+
+// A blank glyph only shows its background.
+static void plot_char_blank(struct flanterm_context *_ctx, uint32_t bg, size_t x, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    uint32_t quad[4] = { bg, bg, bg, bg };
 
-    bool *glyph = &ctx->font_bool[c->c * ctx->font_height * ctx->font_width];
-    // naming: fx,fy for font coordinates, gx,gy for glyph coordinates
     for (size_t gy = 0; gy < ctx->glyph_height; gy++) {
-        uint8_t fy = gy / ctx->font_scale_y;
         volatile uint32_t *fb_line = ctx->framebuffer + x + (y + gy) * (ctx->pitch / 4);
 
 #ifndef FLANTERM_FB_DISABLE_CANVAS
-        uint32_t *canvas_line = ctx->canvas + x + (y + gy) * ctx->width;
+        if (bg == 0xffffffff) {
+            uint32_t *canvas_line = ctx->canvas + x + (y + gy) * ctx->width;
+#ifdef FLANTERM_FB_ENABLE_STAGING
+            store_row(fb_line, canvas_line, ctx->glyph_width);
+#else
+            memcpy((void *)(uintptr_t)fb_line, canvas_line, ctx->glyph_width * sizeof(uint32_t));
+#endif
+            continue;
+        }
 #endif
 
-        for (size_t fx = 0; fx < ctx->font_width; fx++) {
-            bool draw = glyph[fy * ctx->font_width + fx];
-            for (size_t i = 0; i < ctx->font_scale_x; i++) {
-                size_t gx = ctx->font_scale_x * fx + i;
-#ifndef FLANTERM_FB_DISABLE_CANVAS
-                uint32_t bg = c->bg == 0xffffffff ? canvas_line[gx] : c->bg;
-                uint32_t fg = c->fg == 0xffffffff ? canvas_line[gx] : c->fg;
-#else
-                uint32_t bg = c->bg == 0xffffffff ? default_bg : c->bg;
-                uint32_t fg = c->fg == 0xffffffff ? default_bg : c->fg;
+        size_t gx = 0;
+        for (; gx + 4 <= ctx->glyph_width; gx += 4) {
+            __builtin_memcpy((void *)(uintptr_t)(fb_line + gx), quad, sizeof(quad));
+        }
+        for (; gx < ctx->glyph_width; gx++) {
+            fb_line[gx] = bg;
+        }
+    }
+}
+
+// Both colours are solid: unscaled glyph rows are expanded a nibble at a
+// time, scaled ones a font column at a time. The font geometry is passed in
+// so that the kernels below can have it as constants.
+static inline __attribute__((always_inline)) void blit_opaque(struct flanterm_context *_ctx, uint32_t c, uint32_t fg, uint32_t bg, size_t x, size_t y,
+                                                              size_t font_width, size_t font_height, size_t scale_x, size_t scale_y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    uint8_t *glyph = &ctx->font_bits[c * font_height];
+    uint32_t (*lut)[4] = scale_x == 1 ? nibble_lut(_ctx, fg, bg) : NULL;
+
+#ifdef FLANTERM_FB_ENABLE_STAGING
+    // Unscaled rows are already stored 16 bytes at a time below. Scaled
+    // ones are composed once per font row and stored for every glyph row
+    // it is scaled to.
+    if (lut == NULL) {
+        uint32_t *row = ctx->staging;
+        for (size_t fy = 0; fy < font_height; fy++) {
+            uint8_t bits = glyph[fy];
+
+            for (size_t fx = 0; fx < 8; fx++) {
+                uint32_t colour = (bits & (0x80 >> fx)) ? fg : bg;
+                for (size_t i = 0; i < scale_x; i++) {
+                    row[fx * scale_x + i] = colour;
+                }
+            }
+
+            uint32_t extra = glyph_row_extra(c, bits) ? fg : bg;
+            for (size_t gx = 8 * scale_x; gx < font_width * scale_x; gx++) {
+                row[gx] = extra;
+            }
+
+            for (size_t i = 0; i < scale_y; i++) {
+                size_t gy = fy * scale_y + i;
+                store_row(ctx->framebuffer + x + (y + gy) * (ctx->pitch / 4), row, font_width * scale_x);
+            }
+        }
+        return;
+    }
 #endif
-                fb_line[gx] = draw ? fg : bg;
+
+    for (size_t gy = 0; gy < font_height * scale_y; gy++) {
+        uint8_t bits = glyph[gy / scale_y];
+        volatile uint32_t *fb_line = ctx->framebuffer + x + (y + gy) * (ctx->pitch / 4);
+
+        if (lut != NULL) {
+            __builtin_memcpy((void *)(uintptr_t)fb_line, lut[bits >> 4], sizeof(lut[0]));
+            __builtin_memcpy((void *)(uintptr_t)(fb_line + 4), lut[bits & 0xf], sizeof(lut[0]));
+        } else {
+            for (size_t fx = 0; fx < 8; fx++) {
+                uint32_t colour = (bits & (0x80 >> fx)) ? fg : bg;
+                for (size_t i = 0; i < scale_x; i++) {
+                    fb_line[fx * scale_x + i] = colour;
+                }
             }
         }
+
+        uint32_t extra = glyph_row_extra(c, bits) ? fg : bg;
+        for (size_t gx = 8 * scale_x; gx < font_width * scale_x; gx++) {
+            fb_line[gx] = extra;
+        }
     }
 }
 
-#ifdef FLANTERM_FB_ENABLE_MASKING
-static void plot_char_masked(struct flanterm_context *_ctx, struct flanterm_fb_char *old, struct flanterm_fb_char *c, size_t x, size_t y) {
+// Which of the 4 pixels of a nibble are set, for blending two colours.
+#define M 0xffffffff
+static const uint32_t nibble_masks[16][4] = {
+    {0, 0, 0, 0}, {0, 0, 0, M}, {0, 0, M, 0}, {0, 0, M, M},
+    {0, M, 0, 0}, {0, M, 0, M}, {0, M, M, 0}, {0, M, M, M},
+    {M, 0, 0, 0}, {M, 0, 0, M}, {M, 0, M, 0}, {M, 0, M, M},
+    {M, M, 0, 0}, {M, M, 0, M}, {M, M, M, 0}, {M, M, M, M},
+};
+#undef M
+
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+// The canvas shows through wherever a colour is transparent, the *_keep
+// masks select the canvas pixel in place of fg or bg.
+static inline __attribute__((always_inline)) void blit_canvas(struct flanterm_context *_ctx, uint32_t c, uint32_t fg, uint32_t bg, size_t x, size_t y,
+                                                              size_t font_width, size_t font_height, size_t scale_x, size_t scale_y) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    if (x >= _ctx->cols || y >= _ctx->rows) {
-        return;
+    uint8_t *glyph = &ctx->font_bits[c * font_height];
+    uint32_t fg_keep = fg == 0xffffffff ? 0xffffffff : 0;
+    uint32_t bg_keep = bg == 0xffffffff ? 0xffffffff : 0;
+    fg &= ~fg_keep;
+    bg &= ~bg_keep;
+
+    // naming: fx,fy for font coordinates, gx,gy for glyph coordinates
+    for (size_t gy = 0; gy < font_height * scale_y; gy++) {
+        uint8_t bits = glyph[gy / scale_y];
+        // One bit per font column, the leftmost one being the highest.
+        uint32_t row = (uint32_t)bits << 24;
+        if (glyph_row_extra(c, bits)) {
+            row |= 0x00ffffff;
+        }
+        volatile uint32_t *fb_line = ctx->framebuffer + x + (y + gy) * (ctx->pitch / 4);
+        uint32_t *canvas_line = ctx->canvas + x + (y + gy) * ctx->width;
+        volatile uint32_t *out = fb_line;
+#ifdef FLANTERM_FB_ENABLE_STAGING
+        // Scaled rows are composed in the staging buffer and stored at once.
+        if (scale_x != 1) {
+            out = ctx->staging;
+        }
+#endif
+
+        size_t fx = 0;
+        if (scale_x == 1) {
+            // The 8 font columns are blended in a local row and stored at
+            // once.
+            const uint32_t *masks[2] = { nibble_masks[bits >> 4], nibble_masks[bits & 0xf] };
+            uint32_t pixels[8];
+            for (size_t n = 0; n < 2; n++) {
+                for (size_t i = 0; i < 4; i++) {
+                    uint32_t draw = masks[n][i];
+                    uint32_t pixel = canvas_line[n * 4 + i];
+                    pixels[n * 4 + i] = (((pixel & fg_keep) | fg) & draw) | (((pixel & bg_keep) | bg) & ~draw);
+                }
+            }
+            __builtin_memcpy((void *)(uintptr_t)out, pixels, sizeof(pixels));
+            fx = 8;
+        }
+        for (; fx < font_width; fx++) {
+            bool draw = (row << fx) & 0x80000000;
+            for (size_t i = 0; i < scale_x; i++) {
+                size_t gx = scale_x * fx + i;
+                uint32_t pixel = canvas_line[gx];
+                out[gx] = draw ? (pixel & fg_keep) | fg : (pixel & bg_keep) | bg;
+            }
+        }
+#ifdef FLANTERM_FB_ENABLE_STAGING
+        if (scale_x != 1) {
+            store_row(fb_line, ctx->staging, font_width * scale_x);
+        }
+#endif
     }
+}
+#endif
 
-    x = ctx->offset_x + x * ctx->glyph_width;
-    y = ctx->offset_y + y * ctx->glyph_height;
+// Cells are also drawn a span of a screen row at a time, a pixel row of all
+// of them before the next one, so that the framebuffer is written in long
+// sequential lines. The kernels take up to FLANTERM_FB_SPAN_CELLS cells at a
+// time, which they decode up front.
+#ifndef FLANTERM_FB_SPAN_CELLS
+#define FLANTERM_FB_SPAN_CELLS 16
+#endif
 
-#ifdef FLANTERM_FB_DISABLE_CANVAS
-    uint32_t default_bg = ctx->default_bg;
+struct span_cell {
+    uint8_t *glyph;
+    uint32_t c;
+    uint32_t fg, bg;
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+    uint32_t fg_keep, bg_keep;
 #endif
+};
 
-    bool *new_glyph = &ctx->font_bool[c->c * ctx->font_height * ctx->font_width];
-    bool *old_glyph = &ctx->font_bool[old->c * ctx->font_height * ctx->font_width];
-    for (size_t gy = 0; gy < ctx->glyph_height; gy++) {
-        uint8_t fy = gy / ctx->font_scale_y;
+static inline __attribute__((always_inline)) void blit_span(struct flanterm_context *_ctx, struct flanterm_fb_char *cells, size_t count, size_t x, size_t y,
+                                                            size_t font_width, size_t font_height, size_t scale_x, size_t scale_y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    size_t glyph_width = font_width * scale_x;
+
+    struct span_cell span[FLANTERM_FB_SPAN_CELLS];
+    for (size_t i = 0; i < count; i++) {
+        struct span_cell *s = &span[i];
+        uint32_t fg = char_fg(_ctx, &cells[i]), bg = char_bg(_ctx, &cells[i]);
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+        s->fg_keep = fg == 0xffffffff ? 0xffffffff : 0;
+        s->bg_keep = bg == 0xffffffff ? 0xffffffff : 0;
+        fg &= ~s->fg_keep;
+        bg &= ~s->bg_keep;
+#else
+        if (fg == 0xffffffff) {
+            fg = ctx->default_bg;
+        }
+        if (bg == 0xffffffff) {
+            bg = ctx->default_bg;
+        }
+#endif
+        s->c = char_glyph(&cells[i]);
+        s->glyph = &ctx->font_bits[s->c * font_height];
+        s->fg = fg;
+        s->bg = bg;
+    }
+
+    for (size_t gy = 0; gy < font_height * scale_y; gy++) {
+        size_t fy = gy / scale_y;
         volatile uint32_t *fb_line = ctx->framebuffer + x + (y + gy) * (ctx->pitch / 4);
 #ifndef FLANTERM_FB_DISABLE_CANVAS
         uint32_t *canvas_line = ctx->canvas + x + (y + gy) * ctx->width;
 #endif
-        for (size_t fx = 0; fx < ctx->font_width; fx++) {
-            bool old_draw = old_glyph[fy * ctx->font_width + fx];
-            bool new_draw = new_glyph[fy * ctx->font_width + fx];
-            if (old_draw == new_draw)
-                continue;
-            for (size_t i = 0; i < ctx->font_scale_x; i++) {
-                size_t gx = ctx->font_scale_x * fx + i;
+        volatile uint32_t *out = fb_line;
+#ifdef FLANTERM_FB_ENABLE_STAGING
+        out = ctx->staging;
+#endif
+
+        for (size_t i = 0; i < count; i++) {
+            struct span_cell *s = &span[i];
+            uint8_t bits = s->glyph[fy];
+            uint32_t row = (uint32_t)bits << 24;
+            if (glyph_row_extra(s->c, bits)) {
+                row |= 0x00ffffff;
+            }
+            volatile uint32_t *cell_out = out + i * glyph_width;
+            uint32_t fg = s->fg, bg = s->bg;
+
 #ifndef FLANTERM_FB_DISABLE_CANVAS
-                uint32_t bg = c->bg == 0xffffffff ? canvas_line[gx] : c->bg;
-                uint32_t fg = c->fg == 0xffffffff ? canvas_line[gx] : c->fg;
-#else
-                uint32_t bg = c->bg == 0xffffffff ? default_bg : c->bg;
-                uint32_t fg = c->fg == 0xffffffff ? default_bg : c->fg;
+            // As in blit_canvas.
+            if ((s->fg_keep | s->bg_keep) != 0) {
+                uint32_t *cell_canvas = canvas_line + i * glyph_width;
+                size_t fx = 0;
+                if (scale_x == 1) {
+                    const uint32_t *masks[2] = { nibble_masks[bits >> 4], nibble_masks[bits & 0xf] };
+                    uint32_t pixels[8];
+                    for (size_t n = 0; n < 2; n++) {
+                        for (size_t j = 0; j < 4; j++) {
+                            uint32_t draw = masks[n][j];
+                            uint32_t pixel = cell_canvas[n * 4 + j];
+                            pixels[n * 4 + j] = (((pixel & s->fg_keep) | fg) & draw) | (((pixel & s->bg_keep) | bg) & ~draw);
+                        }
+                    }
+                    __builtin_memcpy((void *)(uintptr_t)cell_out, pixels, sizeof(pixels));
+                    fx = 8;
+                }
+                for (; fx < font_width; fx++) {
+                    bool draw = (row << fx) & 0x80000000;
+                    for (size_t j = 0; j < scale_x; j++) {
+                        size_t gx = scale_x * fx + j;
+                        uint32_t pixel = cell_canvas[gx];
+                        cell_out[gx] = draw ? (pixel & s->fg_keep) | fg : (pixel & s->bg_keep) | bg;
+                    }
+                }
+                continue;
+            }
 #endif
-                fb_line[gx] = new_draw ? fg : bg;
+
+            // Solid colours are picked with the same masks.
+            size_t fx = 0;
+            if (scale_x == 1) {
+                const uint32_t *masks[2] = { nibble_masks[bits >> 4], nibble_masks[bits & 0xf] };
+                uint32_t pixels[8];
+                for (size_t n = 0; n < 2; n++) {
+                    for (size_t j = 0; j < 4; j++) {
+                        pixels[n * 4 + j] = bg ^ ((fg ^ bg) & masks[n][j]);
+                    }
+                }
+                __builtin_memcpy((void *)(uintptr_t)cell_out, pixels, sizeof(pixels));
+                fx = 8;
+            }
+            for (; fx < font_width; fx++) {
+                uint32_t colour = (row << fx) & 0x80000000 ? fg : bg;
+                for (size_t j = 0; j < scale_x; j++) {
+                    cell_out[fx * scale_x + j] = colour;
+                }
             }
         }
+
+#ifdef FLANTERM_FB_ENABLE_STAGING
+        store_row(fb_line, ctx->staging, count * glyph_width);
+#endif
+    }
+}
+
+// The generic kernels, for any font geometry.
+static void plot_char_opaque(struct flanterm_context *_ctx, uint32_t c, uint32_t fg, uint32_t bg, size_t x, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+    blit_opaque(_ctx, c, fg, bg, x, y, ctx->font_width, ctx->font_height, ctx->font_scale_x, ctx->font_scale_y);
+}
+
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+static void plot_char_canvas(struct flanterm_context *_ctx, uint32_t c, uint32_t fg, uint32_t bg, size_t x, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+    blit_canvas(_ctx, c, fg, bg, x, y, ctx->font_width, ctx->font_height, ctx->font_scale_x, ctx->font_scale_y);
+}
+#endif
+
+static void plot_span_cells(struct flanterm_context *_ctx, struct flanterm_fb_char *cells, size_t count, size_t x, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+    blit_span(_ctx, cells, count, x, y, ctx->font_width, ctx->font_height, ctx->font_scale_x, ctx->font_scale_y);
+}
+
+#ifndef FLANTERM_FB_DISABLE_GLYPH_KERNELS
+// Kernels for the builtin font with spacing at the scales
+// flanterm_fb_simple_init() picks, which get the loops above unrolled.
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+#define GLYPH_KERNELS(W, H, S) \
+    static void plot_char_opaque_##W##x##H##_##S(struct flanterm_context *_ctx, uint32_t c, uint32_t fg, uint32_t bg, size_t x, size_t y) { \
+        blit_opaque(_ctx, c, fg, bg, x, y, W, H, S, S); \
+    } \
+    static void plot_char_canvas_##W##x##H##_##S(struct flanterm_context *_ctx, uint32_t c, uint32_t fg, uint32_t bg, size_t x, size_t y) { \
+        blit_canvas(_ctx, c, fg, bg, x, y, W, H, S, S); \
+    } \
+    static void plot_span_cells_##W##x##H##_##S(struct flanterm_context *_ctx, struct flanterm_fb_char *cells, size_t count, size_t x, size_t y) { \
+        blit_span(_ctx, cells, count, x, y, W, H, S, S); \
+    }
+#else
+#define GLYPH_KERNELS(W, H, S) \
+    static void plot_char_opaque_##W##x##H##_##S(struct flanterm_context *_ctx, uint32_t c, uint32_t fg, uint32_t bg, size_t x, size_t y) { \
+        blit_opaque(_ctx, c, fg, bg, x, y, W, H, S, S); \
+    } \
+    static void plot_span_cells_##W##x##H##_##S(struct flanterm_context *_ctx, struct flanterm_fb_char *cells, size_t count, size_t x, size_t y) { \
+        blit_span(_ctx, cells, count, x, y, W, H, S, S); \
+    }
+#endif
+
+GLYPH_KERNELS(9, 16, 1)
+GLYPH_KERNELS(9, 16, 2)
+GLYPH_KERNELS(9, 16, 4)
+
+#undef GLYPH_KERNELS
+#endif
+
+static void plot_char(struct flanterm_context *_ctx, struct flanterm_fb_char *c, size_t x, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (x >= _ctx->cols || y >= _ctx->rows) {
+        return;
+    }
+
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+    mark_dirty(_ctx, x, y, 1);
+#endif
+
+    x = ctx->offset_x + x * ctx->glyph_width;
+    y = ctx->offset_y + y * ctx->glyph_height;
+
+    uint32_t fg = char_fg(_ctx, c), bg = char_bg(_ctx, c);
+#ifdef FLANTERM_FB_DISABLE_CANVAS
+    if (fg == 0xffffffff) {
+        fg = ctx->default_bg;
+    }
+    if (bg == 0xffffffff) {
+        bg = ctx->default_bg;
+    }
+#endif
+
+    uint32_t glyph = char_glyph(c);
+    if (ctx->blank_glyphs[glyph]) {
+        plot_char_blank(_ctx, bg, x, y);
+        return;
+    }
+
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+    if (fg == 0xffffffff || bg == 0xffffffff) {
+        ctx->plot_char_canvas(_ctx, glyph, fg, bg, x, y);
+        return;
+    }
+#endif
+
+    ctx->plot_char_opaque(_ctx, glyph, fg, bg, x, y);
+}
+
+// Runs of at least this many cells that look the same, blank cells with the
+// same background or copies of one cell, are filled in rather than drawn
+// glyph by glyph.
+#ifndef FLANTERM_FB_REPEAT_MIN
+#define FLANTERM_FB_REPEAT_MIN 4
+#endif
+
+// Repeated glyphs are composed a pixel row at a time in a buffer of this
+// many pixels, wider glyphs are drawn normally.
+#define REPEAT_LINE 128
+
+static inline void fill_line(volatile uint32_t *dst, uint32_t colour, size_t n) {
+    // Colours with 4 equal bytes, like black and white, are a memset.
+    if ((colour & 0xff) * 0x01010101 == colour) {
+        memset((void *)(uintptr_t)dst, colour & 0xff, n * sizeof(uint32_t));
+        return;
+    }
+
+    uint32_t quad[4] = { colour, colour, colour, colour };
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __builtin_memcpy((void *)(uintptr_t)(dst + i), quad, sizeof(quad));
+    }
+    for (; i < n; i++) {
+        dst[i] = colour;
+    }
+}
+
+// Fills count cells from pixel position x, y with bg, or with the canvas
+// if bg is transparent.
+static void fill_cells(struct flanterm_context *_ctx, uint32_t bg, size_t x, size_t y, size_t count) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+#ifdef FLANTERM_FB_DISABLE_CANVAS
+    if (bg == 0xffffffff) {
+        bg = ctx->default_bg;
+    }
+#endif
+
+    size_t width = count * ctx->glyph_width;
+    for (size_t gy = 0; gy < ctx->glyph_height; gy++) {
+        volatile uint32_t *fb_line = ctx->framebuffer + x + (y + gy) * (ctx->pitch / 4);
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+        if (bg == 0xffffffff) {
+            uint32_t *canvas_line = ctx->canvas + x + (y + gy) * ctx->width;
+#ifdef FLANTERM_FB_ENABLE_STAGING
+            store_row(fb_line, canvas_line, width);
+#else
+            memcpy((void *)(uintptr_t)fb_line, canvas_line, width * sizeof(uint32_t));
+#endif
+            continue;
+        }
+#endif
+        fill_line(fb_line, bg, width);
+    }
+}
+
+// Draws count copies of a cell from pixel position x, y by composing each
+// pixel row of the glyph once and storing it for all of them. Returns false
+// if the cell has to be drawn normally.
+static bool plot_repeat(struct flanterm_context *_ctx, struct flanterm_fb_char *c, size_t x, size_t y, size_t count) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    uint32_t glyph = char_glyph(c);
+    uint32_t fg = char_fg(_ctx, c), bg = char_bg(_ctx, c);
+
+    if (ctx->blank_glyphs[glyph]) {
+        fill_cells(_ctx, bg, x, y, count);
+        return true;
+    }
+
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+    if (fg == 0xffffffff || bg == 0xffffffff) {
+        return false;
+    }
+#else
+    if (fg == 0xffffffff) {
+        fg = ctx->default_bg;
+    }
+    if (bg == 0xffffffff) {
+        bg = ctx->default_bg;
+    }
+#endif
+
+    size_t glyph_width = ctx->glyph_width;
+    if (glyph_width > REPEAT_LINE) {
+        return false;
+    }
+    size_t per_line = REPEAT_LINE / glyph_width;
+    if (per_line > count) {
+        per_line = count;
+    }
+
+    uint32_t line[REPEAT_LINE];
+    uint8_t *glyph_bits = &ctx->font_bits[glyph * ctx->font_height];
+    for (size_t gy = 0; gy < ctx->glyph_height; gy++) {
+        uint8_t bits = glyph_bits[gy / ctx->font_scale_y];
+        uint32_t row = (uint32_t)bits << 24;
+        if (glyph_row_extra(glyph, bits)) {
+            row |= 0x00ffffff;
+        }
+        for (size_t fx = 0; fx < ctx->font_width; fx++) {
+            uint32_t colour = (row << fx) & 0x80000000 ? fg : bg;
+            for (size_t i = 0; i < ctx->font_scale_x; i++) {
+                line[fx * ctx->font_scale_x + i] = colour;
+            }
+        }
+        for (size_t i = 1; i < per_line; i++) {
+            memcpy(&line[i * glyph_width], line, glyph_width * sizeof(uint32_t));
+        }
+
+        volatile uint32_t *fb_line = ctx->framebuffer + x + (y + gy) * (ctx->pitch / 4);
+        for (size_t done = 0; done < count; done += per_line) {
+            size_t n = count - done < per_line ? count - done : per_line;
+#ifdef FLANTERM_FB_ENABLE_STAGING
+            store_row(fb_line + done * glyph_width, line, n * glyph_width);
+#else
+            memcpy((void *)(uintptr_t)(fb_line + done * glyph_width), line, n * glyph_width * sizeof(uint32_t));
+#endif
+        }
+    }
+
+    return true;
+}
+
+#undef REPEAT_LINE
+
+// How many cells from the first one on look the same as it.
+static size_t repeat_run(struct flanterm_context *_ctx, struct flanterm_fb_char *cells, size_t count) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    size_t n = 1;
+    if (ctx->blank_glyphs[char_glyph(&cells[0])]) {
+        while (n < count && ctx->blank_glyphs[char_glyph(&cells[n])] && compare_bg(&cells[n], &cells[0])) {
+            n++;
+        }
+    } else {
+        while (n < count && compare_char(&cells[n], &cells[0])) {
+            n++;
+        }
+    }
+    return n;
+}
+
+// Draws count cells with the span kernels, x and y in pixels.
+static void plot_span_chunks(struct flanterm_context *_ctx, struct flanterm_fb_char *cells, size_t x, size_t y, size_t count) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    while (count != 0) {
+        size_t n = count < FLANTERM_FB_SPAN_CELLS ? count : FLANTERM_FB_SPAN_CELLS;
+        ctx->plot_span_cells(_ctx, cells, n, x, y);
+        cells += n;
+        count -= n;
+        x += n * ctx->glyph_width;
+    }
+}
+
+// Draws count cells side by side, starting at screen position x, y.
+static void plot_span(struct flanterm_context *_ctx, struct flanterm_fb_char *cells, size_t x, size_t y, size_t count) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (x >= _ctx->cols || y >= _ctx->rows || count == 0) {
+        return;
+    }
+    if (count > _ctx->cols - x) {
+        count = _ctx->cols - x;
+    }
+
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+    mark_dirty(_ctx, x, y, count);
+#endif
+
+    x = ctx->offset_x + x * ctx->glyph_width;
+    y = ctx->offset_y + y * ctx->glyph_height;
+
+    // Cells before start are drawn, those from start to i are left for the
+    // span kernels.
+    size_t start = 0;
+    for (size_t i = 0; i < count;) {
+        size_t n = repeat_run(_ctx, &cells[i], count - i);
+        if (n >= FLANTERM_FB_REPEAT_MIN && plot_repeat(_ctx, &cells[i], x + i * ctx->glyph_width, y, n)) {
+            plot_span_chunks(_ctx, &cells[start], x + start * ctx->glyph_width, y, i - start);
+            start = i + n;
+        }
+        i += n;
+    }
+    plot_span_chunks(_ctx, &cells[start], x + start * ctx->glyph_width, y, count - start);
+}
+
+#ifdef FLANTERM_FB_ENABLE_MASKING
+static void plot_char_masked(struct flanterm_context *_ctx, struct flanterm_fb_char *old, struct flanterm_fb_char *c, size_t x, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (x >= _ctx->cols || y >= _ctx->rows) {
+        return;
+    }
+
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+    mark_dirty(_ctx, x, y, 1);
+#endif
+
+    x = ctx->offset_x + x * ctx->glyph_width;
+    y = ctx->offset_y + y * ctx->glyph_height;
+
+    uint32_t fg = char_fg(_ctx, c), bg = char_bg(_ctx, c);
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+    // As in blit_canvas, the canvas is only read if it shows through.
+    uint32_t fg_keep = fg == 0xffffffff ? 0xffffffff : 0;
+    uint32_t bg_keep = bg == 0xffffffff ? 0xffffffff : 0;
+    bool canvas = (fg_keep | bg_keep) != 0;
+    fg &= ~fg_keep;
+    bg &= ~bg_keep;
+#else
+    if (fg == 0xffffffff) {
+        fg = ctx->default_bg;
+    }
+    if (bg == 0xffffffff) {
+        bg = ctx->default_bg;
+    }
+#endif
+
+    uint32_t new_c = char_glyph(c), old_c = char_glyph(old);
+    uint8_t *new_glyph = &ctx->font_bits[new_c * ctx->font_height];
+    uint8_t *old_glyph = &ctx->font_bits[old_c * ctx->font_height];
+    for (size_t gy = 0; gy < ctx->glyph_height; gy++) {
+        uint8_t fy = gy / ctx->font_scale_y;
+        uint8_t new_bits = new_glyph[fy];
+        bool new_extra = glyph_row_extra(new_c, new_bits);
+        bool old_extra = glyph_row_extra(old_c, old_glyph[fy]);
+        // Only the pixels that flip between the two glyphs are drawn.
+        uint8_t changed = new_bits ^ old_glyph[fy];
+        if (changed == 0 && (new_extra == old_extra || ctx->font_width == 8)) {
+            continue;
+        }
+        volatile uint32_t *fb_line = ctx->framebuffer + x + (y + gy) * (ctx->pitch / 4);
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+        uint32_t *canvas_line = ctx->canvas + x + (y + gy) * ctx->width;
+#endif
+        for (size_t fx = 0; fx < ctx->font_width; fx++) {
+            bool new_draw;
+            if (fx < 8) {
+                if (!(changed & (0x80 >> fx))) {
+                    continue;
+                }
+                new_draw = new_bits & (0x80 >> fx);
+            } else {
+                if (new_extra == old_extra) {
+                    break;
+                }
+                new_draw = new_extra;
+            }
+            uint32_t colour = new_draw ? fg : bg;
+            for (size_t i = 0; i < ctx->font_scale_x; i++) {
+                size_t gx = ctx->font_scale_x * fx + i;
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+                if (canvas) {
+                    fb_line[gx] = colour | (canvas_line[gx] & (new_draw ? fg_keep : bg_keep));
+                    continue;
+                }
+#endif
+                fb_line[gx] = colour;
+            }
+        }
+    }
+}
+#endif
+
+// In drawn_rows, a screen row whose pixels do not show any grid row.
+#define NO_ROW ((size_t)-1)
+
+// Index of the cell at screen position x, y in grid and pending.
+static inline size_t grid_index(struct flanterm_context *_ctx, size_t x, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    return ctx->grid_rows[y] * _ctx->cols + x;
+}
+
+static inline uint64_t *pending_row_bits(struct flanterm_context *_ctx, size_t row) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    return &ctx->pending_bits[row * ctx->pending_words];
+}
+
+static inline bool pending_bit(struct flanterm_context *_ctx, size_t row, size_t x) {
+    return (pending_row_bits(_ctx, row)[x / 64] >> (x % 64)) & 1;
+}
+
+// What the cell at column x of grid row row holds once the pending changes
+// are flushed.
+static inline struct flanterm_fb_char *pending_char(struct flanterm_context *_ctx, size_t row, size_t x) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    struct flanterm_fb_row_state *state = &ctx->row_state[row];
+
+    if (pending_bit(_ctx, row, x)) {
+        return &ctx->pending[row * _ctx->cols + x];
+    }
+    if (state->cleared) {
+        return &state->blank;
+    }
+    return &ctx->grid[row * _ctx->cols + x];
+}
+
+static void push_char(struct flanterm_context *_ctx, struct flanterm_fb_char *c, size_t x, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (x >= _ctx->cols || y >= _ctx->rows) {
+        return;
+    }
+
+    size_t row = ctx->grid_rows[y];
+    size_t i = row * _ctx->cols + x;
+
+    uint64_t *word = &pending_row_bits(_ctx, row)[x / 64];
+    uint64_t bit = (uint64_t)1 << (x % 64);
+
+    if (!(*word & bit)) {
+        struct flanterm_fb_row_state *state = &ctx->row_state[row];
+        if (compare_char(state->cleared ? &state->blank : &ctx->grid[i], c)) {
+            return;
+        }
+        *word |= bit;
+        state->pending = true;
+    }
+
+    ctx->pending[i] = *c;
+}
+
+static void clear_row(struct flanterm_context *_ctx, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    size_t row = ctx->grid_rows[y];
+    struct flanterm_fb_row_state *state = &ctx->row_state[row];
+
+    state->cleared = true;
+    state->pending = false;
+    memset(pending_row_bits(_ctx, row), 0, ctx->pending_words * sizeof(uint64_t));
+    make_char(_ctx, &state->blank, ' ');
+}
+
+// Scrolling does not move any cells, only the grid rows the screen rows of
+// the scroll region are stored in. The row that leaves the region is reused
+// for the one that enters it and cleared.
+
+static void flanterm_fb_revscroll(struct flanterm_context *_ctx, size_t top, size_t bottom, size_t count) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (count > bottom - top) {
+        count = bottom - top;
+    }
+
+    // Rotate the rows of the region down by count, the rows falling off the
+    // bottom come back in at the top.
+    size_t *rows = ctx->row_scratch;
+    for (size_t i = 0; i < count; i++) {
+        rows[i] = ctx->grid_rows[bottom - count + i];
+    }
+    for (size_t y = bottom - 1; y >= top + count; y--) {
+        ctx->grid_rows[y] = ctx->grid_rows[y - count];
+    }
+    for (size_t i = 0; i < count; i++) {
+        ctx->grid_rows[top + i] = rows[i];
+    }
+
+    // Clear the lines that entered at the top.
+    for (size_t y = top; y < top + count; y++) {
+        clear_row(_ctx, y);
+    }
+}
+
+static void flanterm_fb_scroll(struct flanterm_context *_ctx, size_t top, size_t bottom, size_t count) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (count > bottom - top) {
+        count = bottom - top;
+    }
+
+    size_t *rows = ctx->row_scratch;
+    for (size_t i = 0; i < count; i++) {
+        rows[i] = ctx->grid_rows[top + i];
+    }
+    for (size_t y = top; y < bottom - count; y++) {
+        ctx->grid_rows[y] = ctx->grid_rows[y + count];
+    }
+    for (size_t i = 0; i < count; i++) {
+        ctx->grid_rows[bottom - count + i] = rows[i];
+    }
+
+    // Clear the lines that entered at the bottom.
+    for (size_t y = bottom - count; y < bottom; y++) {
+        clear_row(_ctx, y);
+    }
+}
+
+static void flanterm_fb_clear(struct flanterm_context *_ctx, bool move) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    for (size_t y = 0; y < _ctx->rows; y++) {
+        clear_row(_ctx, y);
+    }
+
+    if (move) {
+        ctx->cursor_x = 0;
+        ctx->cursor_y = 0;
+    }
+}
+
+static void flanterm_fb_fill_region(struct flanterm_context *_ctx, size_t x0, size_t y0, size_t x1, size_t y1, uint8_t c) {
+    if (x1 > _ctx->cols) {
+        x1 = _ctx->cols;
+    }
+    if (y1 > _ctx->rows) {
+        y1 = _ctx->rows;
+    }
+
+    struct flanterm_fb_char ch;
+    make_char(_ctx, &ch, c);
+
+    for (size_t y = y0; y < y1; y++) {
+        // Blanking a whole row is a clear, which leaves the cells alone
+        // until the next flush.
+        if (c == ' ' && x0 == 0 && x1 == _ctx->cols) {
+            clear_row(_ctx, y);
+            continue;
+        }
+        for (size_t x = x0; x < x1; x++) {
+            push_char(_ctx, &ch, x, y);
+        }
+    }
+}
+
+static void flanterm_fb_set_cursor_pos(struct flanterm_context *_ctx, size_t x, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (x >= _ctx->cols) {
+        if ((int)x < 0) {
+            x = 0;
+        } else {
+            x = _ctx->cols - 1;
+        }
+    }
+    if (y >= _ctx->rows) {
+        if ((int)y < 0) {
+            y = 0;
+        } else {
+            y = _ctx->rows - 1;
+        }
+    }
+    ctx->cursor_x = x;
+    ctx->cursor_y = y;
+}
+
+static void flanterm_fb_get_cursor_pos(struct flanterm_context *_ctx, size_t *x, size_t *y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    *x = ctx->cursor_x >= _ctx->cols ? _ctx->cols - 1 : ctx->cursor_x;
+    *y = ctx->cursor_y >= _ctx->rows ? _ctx->rows - 1 : ctx->cursor_y;
+}
+
+static void flanterm_fb_move_character(struct flanterm_context *_ctx, size_t new_x, size_t new_y, size_t old_x, size_t old_y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (old_x >= _ctx->cols || old_y >= _ctx->rows
+     || new_x >= _ctx->cols || new_y >= _ctx->rows) {
+        return;
+    }
+
+    struct flanterm_fb_char c = *pending_char(_ctx, ctx->grid_rows[old_y], old_x);
+
+    push_char(_ctx, &c, new_x, new_y);
+}
+
+static void flanterm_fb_move_span(struct flanterm_context *_ctx, size_t y, size_t dst_x, size_t src_x, size_t len) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (y >= _ctx->rows || dst_x >= _ctx->cols || src_x >= _ctx->cols) {
+        return;
+    }
+    if (len > _ctx->cols - dst_x) {
+        len = _ctx->cols - dst_x;
+    }
+    if (len > _ctx->cols - src_x) {
+        len = _ctx->cols - src_x;
+    }
+
+    // grid holds what is on screen, so the cells are moved through the
+    // pending cells, in the order that reads every source cell before it is
+    // overwritten. The row is looked up once, the stores to the bits would
+    // otherwise force it to be reloaded for every cell.
+    size_t row = ctx->grid_rows[y];
+    struct flanterm_fb_row_state *state = &ctx->row_state[row];
+    struct flanterm_fb_char *grid = state->cleared ? NULL : &ctx->grid[row * _ctx->cols];
+    struct flanterm_fb_char *pending = &ctx->pending[row * _ctx->cols];
+    uint64_t *bits = pending_row_bits(_ctx, row);
+
+    bool backwards = dst_x > src_x;
+    for (size_t j = 0; j < len; j++) {
+        size_t i = backwards ? len - 1 - j : j;
+        size_t src = src_x + i, dst = dst_x + i;
+
+        struct flanterm_fb_char c;
+        if ((bits[src / 64] >> (src % 64)) & 1) {
+            c = pending[src];
+        } else {
+            c = grid != NULL ? grid[src] : state->blank;
+        }
+
+        uint64_t bit = (uint64_t)1 << (dst % 64);
+        if (!(bits[dst / 64] & bit)) {
+            if (compare_char(grid != NULL ? &grid[dst] : &state->blank, &c)) {
+                continue;
+            }
+            bits[dst / 64] |= bit;
+            state->pending = true;
+        }
+        pending[dst] = c;
+    }
+}
+
+static void flanterm_fb_set_text_fg(struct flanterm_context *_ctx, size_t fg) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    ctx->text_fg = ctx->ansi_colours[fg];
+    update_text_colours(_ctx);
+}
+
+static void flanterm_fb_set_text_bg(struct flanterm_context *_ctx, size_t bg) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    ctx->text_bg = ctx->ansi_colours[bg];
+    update_text_colours(_ctx);
+}
+
+static void flanterm_fb_set_text_fg_bright(struct flanterm_context *_ctx, size_t fg) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    ctx->text_fg = ctx->ansi_bright_colours[fg];
+    update_text_colours(_ctx);
+}
+
+static void flanterm_fb_set_text_bg_bright(struct flanterm_context *_ctx, size_t bg) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    ctx->text_bg = ctx->ansi_bright_colours[bg];
+    update_text_colours(_ctx);
+}
+
+static void flanterm_fb_set_text_fg_rgb(struct flanterm_context *_ctx, uint32_t fg) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    ctx->text_fg = convert_colour(_ctx, fg);
+    update_text_colours(_ctx);
+}
+
+static void flanterm_fb_set_text_bg_rgb(struct flanterm_context *_ctx, uint32_t bg) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    ctx->text_bg = convert_colour(_ctx, bg);
+    update_text_colours(_ctx);
+}
+
+static void flanterm_fb_set_text_fg_default(struct flanterm_context *_ctx) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    ctx->text_fg = ctx->default_fg;
+    update_text_colours(_ctx);
+}
+
+static void flanterm_fb_set_text_bg_default(struct flanterm_context *_ctx) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    ctx->text_bg = 0xffffffff;
+    update_text_colours(_ctx);
+}
+
+static void flanterm_fb_set_text_fg_default_bright(struct flanterm_context *_ctx) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    ctx->text_fg = ctx->default_fg_bright;
+    update_text_colours(_ctx);
+}
+
+static void flanterm_fb_set_text_bg_default_bright(struct flanterm_context *_ctx) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    ctx->text_bg = ctx->default_bg_bright;
+    update_text_colours(_ctx);
+}
+
+static void draw_cursor(struct flanterm_context *_ctx) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (ctx->cursor_x >= _ctx->cols || ctx->cursor_y >= _ctx->rows) {
+        return;
+    }
+
+    struct flanterm_fb_char c = *pending_char(_ctx, ctx->grid_rows[ctx->cursor_y], ctx->cursor_x);
+    swap_colours(&c);
+    plot_char(_ctx, &c, ctx->cursor_x, ctx->cursor_y);
+}
+
+#ifndef FLANTERM_FB_DISABLE_SCROLL_COPY
+
+// A scrolled row is copied if at least 1/FLANTERM_FB_SCROLL_COPY_RATIO of its
+// cells would have to be replotted otherwise.
+#ifndef FLANTERM_FB_SCROLL_COPY_RATIO
+#define FLANTERM_FB_SCROLL_COPY_RATIO 4
+#endif
+
+static void copy_row_pixels(struct flanterm_context *_ctx, size_t dst_y, size_t src_y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    size_t stride = ctx->pitch / 4;
+    size_t line_size = _ctx->cols * ctx->glyph_width * sizeof(uint32_t);
+
+    volatile uint32_t *dst = ctx->framebuffer + ctx->offset_x + (ctx->offset_y + dst_y * ctx->glyph_height) * stride;
+    volatile uint32_t *src = ctx->framebuffer + ctx->offset_x + (ctx->offset_y + src_y * ctx->glyph_height) * stride;
+
+    for (size_t gy = 0; gy < ctx->glyph_height; gy++) {
+        memcpy((void *)(uintptr_t)dst, (const void *)(uintptr_t)src, line_size);
+        dst += stride;
+        src += stride;
+    }
+
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+    mark_dirty(_ctx, 0, dst_y, _ctx->cols);
+#endif
+
+    // Cells that were still to be plotted are now so at dst_y.
+    memcpy(&ctx->damage_bits[dst_y * ctx->pending_words], &ctx->damage_bits[src_y * ctx->pending_words],
+           ctx->pending_words * sizeof(uint64_t));
+}
+
+// Whether copying the pixels of screen row y from where its contents were
+// drawn beats replotting the cells that differ from what it shows now.
+static bool worth_copying(struct flanterm_context *_ctx, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (ctx->drawn_rows[y] == NO_ROW) {
+        return true;
+    }
+
+    size_t row = ctx->grid_rows[y];
+    struct flanterm_fb_char *shown_row = &ctx->grid[ctx->drawn_rows[y] * _ctx->cols];
+
+    size_t threshold = _ctx->cols / FLANTERM_FB_SCROLL_COPY_RATIO;
+    size_t changed = 0;
+    for (size_t x = 0; x < _ctx->cols; x++) {
+        if (!compare_char(pending_char(_ctx, row, x), &shown_row[x]) && ++changed > threshold) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves the pixels of screen rows that scrolled since the last flush to where
+// they are now, so that only what changed in them has to be plotted.
+static void move_scrolled_rows(struct flanterm_context *_ctx) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    // The screen row each grid row was drawn at, if any.
+    size_t *drawn_at = ctx->row_scratch;
+    bool moved = false;
+    for (size_t row = 0; row < _ctx->rows; row++) {
+        drawn_at[row] = NO_ROW;
+    }
+    for (size_t y = 0; y < _ctx->rows; y++) {
+        if (ctx->drawn_rows[y] != NO_ROW) {
+            drawn_at[ctx->drawn_rows[y]] = y;
+        }
+        if (ctx->drawn_rows[y] != ctx->grid_rows[y]) {
+            moved = true;
+        }
+    }
+    if (!moved) {
+        return;
+    }
+
+    // Do not carry the cursor along with its row.
+    if (ctx->old_cursor_x < _ctx->cols && ctx->old_cursor_y < _ctx->rows) {
+        size_t drawn = ctx->drawn_rows[ctx->old_cursor_y];
+        if (drawn != NO_ROW) {
+            plot_char(_ctx, &ctx->grid[drawn * _ctx->cols + ctx->old_cursor_x], ctx->old_cursor_x, ctx->old_cursor_y);
+        }
+    }
+
+    // Rows moving up are copied top to bottom and rows moving down bottom to
+    // top, so no row is overwritten before it is copied within its group.
+    // Rows moving down whose source was already overwritten by a row moving
+    // up are left to be replotted, as is anything not worth copying.
+    for (size_t y = 0; y < _ctx->rows; y++) {
+        size_t from = drawn_at[ctx->grid_rows[y]];
+        if (from != NO_ROW && from > y && worth_copying(_ctx, y)) {
+            copy_row_pixels(_ctx, y, from);
+            ctx->drawn_rows[y] = ctx->grid_rows[y];
+        }
+    }
+    for (size_t y = _ctx->rows; y-- > 0;) {
+        size_t from = drawn_at[ctx->grid_rows[y]];
+        if (from == NO_ROW || from >= y || !worth_copying(_ctx, y)) {
+            continue;
+        }
+        if (drawn_at[ctx->grid_rows[from]] > from && ctx->drawn_rows[from] == ctx->grid_rows[from]) {
+            continue;
+        }
+        copy_row_pixels(_ctx, y, from);
+        ctx->drawn_rows[y] = ctx->grid_rows[y];
+    }
+}
+#endif
+
+// The flush plots the cells that changed a tile of about this many pixels
+// at a time, rather than a whole screen row at a time, so that on large
+// framebuffers the writes of a tile stay within a few pages and cache
+// lines. 1024 pixels of 32 bits are a 4 KiB page.
+#ifndef FLANTERM_FB_TILE_WIDTH
+#define FLANTERM_FB_TILE_WIDTH 1024
+#endif
+#ifndef FLANTERM_FB_TILE_HEIGHT
+#define FLANTERM_FB_TILE_HEIGHT 64
+#endif
+
+static void clear_bits(uint64_t *bits, size_t start, size_t end) {
+    while (start < end) {
+        size_t n = 64 - start % 64;
+        if (n > end - start) {
+            n = end - start;
+        }
+        uint64_t mask = n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+        bits[start / 64] &= ~(mask << (start % 64));
+        start += n;
+    }
+}
+
+// Plots at most budget of the cells x0 to x1 - 1 of screen row y marked in
+// damage_bits, each run of them in one go, and clears their bits. Returns
+// how many it plotted.
+static size_t plot_damage(struct flanterm_context *_ctx, size_t y, size_t x0, size_t x1, size_t budget) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    uint64_t *damage = &ctx->damage_bits[y * ctx->pending_words];
+    struct flanterm_fb_char *grid_row = &ctx->grid[ctx->grid_rows[y] * _ctx->cols];
+
+    size_t plotted = 0;
+    size_t x = x0;
+    while (x < x1 && plotted < budget) {
+        uint64_t word = damage[x / 64] & (~(uint64_t)0 << (x % 64));
+        if (word == 0) {
+            x = (x / 64 + 1) * 64;
+            continue;
+        }
+        size_t start = (x / 64) * 64 + __builtin_ctzll(word);
+        if (start >= x1) {
+            break;
+        }
+
+        // The run ends at the next clear bit. Bits past the last column are
+        // never set.
+        x = start;
+        for (;;) {
+            word = ~damage[x / 64] & (~(uint64_t)0 << (x % 64));
+            if (word != 0) {
+                x = (x / 64) * 64 + __builtin_ctzll(word);
+                break;
+            }
+            x = (x / 64 + 1) * 64;
+        }
+        if (x > x1) {
+            x = x1;
+        }
+        if (x - start > budget - plotted) {
+            x = start + budget - plotted;
+        }
+
+        clear_bits(damage, start, x);
+        plot_span(_ctx, &grid_row[start], start, y, x - start);
+        plotted += x - start;
+    }
+
+    return plotted;
+}
+
+// Plots the damage of screen rows y0 to y1 - 1 a tile at a time, at most
+// *budget cells, taking them off it. Rows that scrolled and were not
+// committed yet are left alone, their damage is not against their grid row.
+static void plot_damage_rows(struct flanterm_context *_ctx, size_t y0, size_t y1, size_t *budget) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    for (size_t x0 = 0; x0 < _ctx->cols; x0 += ctx->tile_cols) {
+        size_t x1 = x0 + ctx->tile_cols < _ctx->cols ? x0 + ctx->tile_cols : _ctx->cols;
+        for (size_t y = y0; y < y1; y++) {
+            if (ctx->drawn_rows[y] != ctx->grid_rows[y]) {
+                continue;
+            }
+            *budget -= plot_damage(_ctx, y, x0, x1, *budget);
+            if (*budget == 0) {
+                return;
+            }
+        }
+    }
+}
+
+// Plots the changed cells of a band of tile_rows screen rows from the grid.
+static void flush_band(struct flanterm_context *_ctx, size_t band) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    size_t y0 = band * ctx->tile_rows;
+    size_t y1 = y0 + ctx->tile_rows < _ctx->rows ? y0 + ctx->tile_rows : _ctx->rows;
+    size_t budget = SIZE_MAX;
+    plot_damage_rows(_ctx, y0, y1, &budget);
+}
+
+// Bands draw disjoint parts of the framebuffer and only touch state of their
+// own rows, so they are handed to the client's parallel_for() if there is
+// one. Each call takes bands until there are none left, so calls that got
+// bands with little damage go on to help with the others. The span kernels
+// share the staging buffer, so with it bands are drawn one after the other.
+#ifndef FLANTERM_FB_ENABLE_STAGING
+struct band_queue {
+    size_t next;
+    size_t count;
+    void (*draw)(struct flanterm_context *, size_t band);
+};
+
+static void draw_bands_worker(struct flanterm_context *_ctx, size_t i, void *arg) {
+    struct band_queue *queue = arg;
+
+    (void)i;
+
+    for (;;) {
+        size_t band = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+        if (band >= queue->count) {
+            return;
+        }
+        queue->draw(_ctx, band);
     }
 }
 #endif
 
-static inline bool compare_char(struct flanterm_fb_char *a, struct flanterm_fb_char *b) {
-    return !(a->c != b->c || a->bg != b->bg || a->fg != b->fg);
-}
-
-static void push_to_queue(struct flanterm_context *_ctx, struct flanterm_fb_char *c, size_t x, size_t y) {
+static void draw_bands(struct flanterm_context *_ctx, void (*draw)(struct flanterm_context *, size_t band)) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    if (x >= _ctx->cols || y >= _ctx->rows) {
+    size_t bands = (_ctx->rows + ctx->tile_rows - 1) / ctx->tile_rows;
+
+#ifndef FLANTERM_FB_ENABLE_STAGING
+    if (_ctx->parallel_for != NULL && bands > 1) {
+        struct band_queue queue = { 0, bands, draw };
+        _ctx->parallel_for(_ctx, bands, draw_bands_worker, &queue);
         return;
     }
+#endif
 
-    size_t i = y * _ctx->cols + x;
-
-    struct flanterm_fb_queue_item *q = ctx->map[i];
-
-    if (q == NULL) {
-        if (compare_char(&ctx->grid[i], c)) {
-            return;
-        }
-        q = &ctx->queue[ctx->queue_i++];
-        q->x = x;
-        q->y = y;
-        ctx->map[i] = q;
+    for (size_t band = 0; band < bands; band++) {
+        draw(_ctx, band);
     }
-
-    q->c = *c;
 }
 
-static void flanterm_fb_revscroll(struct flanterm_context *_ctx) {
+// Marking and unmarking single cells keeps damage_cells up to date. Runs
+// of cells plotted from damage_bits are taken off it by the caller.
+static inline void mark_damage(struct flanterm_context *_ctx, uint64_t *damage, size_t x) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    for (size_t i = (_ctx->scroll_bottom_margin - 1) * _ctx->cols - 1;
-         i >= _ctx->scroll_top_margin * _ctx->cols; i--) {
-        if (i == (size_t)-1) {
-            break;
-        }
-        struct flanterm_fb_char *c;
-        struct flanterm_fb_queue_item *q = ctx->map[i];
-        if (q != NULL) {
-            c = &q->c;
-        } else {
-            c = &ctx->grid[i];
-        }
-        push_to_queue(_ctx, c, (i + _ctx->cols) % _ctx->cols, (i + _ctx->cols) / _ctx->cols);
+    uint64_t bit = (uint64_t)1 << (x % 64);
+    if (!(damage[x / 64] & bit)) {
+        damage[x / 64] |= bit;
+        ctx->damage_cells++;
     }
+}
+
+static inline void unmark_damage(struct flanterm_context *_ctx, size_t x, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    // Clear the first line of the screen.
-    struct flanterm_fb_char empty;
-    empty.c  = ' ';
-    empty.fg = ctx->text_fg;
-    empty.bg = ctx->text_bg;
-    for (size_t i = 0; i < _ctx->cols; i++) {
-        push_to_queue(_ctx, &empty, i, _ctx->scroll_top_margin);
+    uint64_t *word = &ctx->damage_bits[y * ctx->pending_words + x / 64];
+    uint64_t bit = (uint64_t)1 << (x % 64);
+    if (*word & bit) {
+        *word &= ~bit;
+        ctx->damage_cells--;
     }
 }
 
-static void flanterm_fb_scroll(struct flanterm_context *_ctx) {
+// Screen row y shows the grid row it is stored in, and that is up to date.
+static inline bool row_committed(struct flanterm_context *_ctx, size_t y) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    for (size_t i = (_ctx->scroll_top_margin + 1) * _ctx->cols;
-         i < _ctx->scroll_bottom_margin * _ctx->cols; i++) {
-        struct flanterm_fb_char *c;
-        struct flanterm_fb_queue_item *q = ctx->map[i];
-        if (q != NULL) {
-            c = &q->c;
-        } else {
-            c = &ctx->grid[i];
-        }
-        push_to_queue(_ctx, c, (i - _ctx->cols) % _ctx->cols, (i - _ctx->cols) / _ctx->cols);
-    }
+    size_t row = ctx->grid_rows[y];
+    struct flanterm_fb_row_state *state = &ctx->row_state[row];
 
-    // Clear the last line of the screen.
-    struct flanterm_fb_char empty;
-    empty.c  = ' ';
-    empty.fg = ctx->text_fg;
-    empty.bg = ctx->text_bg;
-    for (size_t i = 0; i < _ctx->cols; i++) {
-        push_to_queue(_ctx, &empty, i, _ctx->scroll_bottom_margin - 1);
-    }
+    return ctx->drawn_rows[y] == row && !state->cleared && !state->pending;
 }
 
-static void flanterm_fb_clear(struct flanterm_context *_ctx, bool move) {
+// If screen row y scrolled since it was drawn, marks the cells where what it
+// shows differs from what it is to show, all of them if it shows nothing.
+// This has to happen before the grid row it shows is written back to. Returns
+// how many cells it compared.
+static size_t diff_scrolled_row(struct flanterm_context *_ctx, size_t y) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    struct flanterm_fb_char empty;
-    empty.c  = ' ';
-    empty.fg = ctx->text_fg;
-    empty.bg = ctx->text_bg;
-    for (size_t i = 0; i < _ctx->rows * _ctx->cols; i++) {
-        push_to_queue(_ctx, &empty, i % _ctx->cols, i / _ctx->cols);
+    size_t row = ctx->grid_rows[y];
+    size_t drawn = ctx->drawn_rows[y];
+    if (row == drawn) {
+        return 0;
     }
 
-    if (move) {
-        ctx->cursor_x = 0;
-        ctx->cursor_y = 0;
+    uint64_t *damage = &ctx->damage_bits[y * ctx->pending_words];
+    for (size_t x = 0; x < _ctx->cols; x++) {
+        if (drawn == NO_ROW || !compare_char(&ctx->grid[drawn * _ctx->cols + x], pending_char(_ctx, row, x))) {
+            mark_damage(_ctx, damage, x);
+        }
     }
+    return _ctx->cols;
 }
 
-static void flanterm_fb_set_cursor_pos(struct flanterm_context *_ctx, size_t x, size_t y) {
+// Writes the pending cells of screen row y back to the grid, marking those
+// that changed if the row is still drawn where it is, after which screen row
+// y shows its grid row outside of marked cells. Cleared rows take their
+// blank wherever no cell was written since. Returns how many cells it went
+// through.
+static size_t write_back_row(struct flanterm_context *_ctx, size_t y, bool plot_masked) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    if (x >= _ctx->cols) {
-        if ((int)x < 0) {
-            x = 0;
-        } else {
-            x = _ctx->cols - 1;
-        }
+#ifndef FLANTERM_FB_ENABLE_MASKING
+    (void)plot_masked;
+#endif
+
+    size_t row = ctx->grid_rows[y];
+    struct flanterm_fb_row_state *state = &ctx->row_state[row];
+    bool in_place = ctx->drawn_rows[y] == row;
+    ctx->drawn_rows[y] = row;
+    if (!state->cleared && !state->pending) {
+        return 0;
     }
-    if (y >= _ctx->rows) {
-        if ((int)y < 0) {
-            y = 0;
-        } else {
-            y = _ctx->rows - 1;
+
+    uint64_t *bits = pending_row_bits(_ctx, row);
+    uint64_t *damage = &ctx->damage_bits[y * ctx->pending_words];
+    size_t count = 0;
+
+    for (size_t w = 0; w < ctx->pending_words; w++) {
+        // Cleared rows go through every cell, others only the pending ones.
+        uint64_t todo = state->cleared ? ~(uint64_t)0 : bits[w];
+        while (todo != 0) {
+            size_t x = w * 64 + __builtin_ctzll(todo);
+            todo &= todo - 1;
+            if (x >= _ctx->cols) {
+                break;
+            }
+            count++;
+
+            size_t offset = row * _ctx->cols + x;
+            struct flanterm_fb_char *c = (bits[w] >> (x % 64)) & 1 ? &ctx->pending[offset] : &state->blank;
+            struct flanterm_fb_char *old = &ctx->grid[offset];
+            if (in_place && !compare_char(old, c)) {
+#ifdef FLANTERM_FB_ENABLE_MASKING
+                // Only over pixels that show old.
+                if (plot_masked && !((damage[w] >> (x % 64)) & 1) && compare_colours(c, old)) {
+                    plot_char_masked(_ctx, old, c, x, y);
+                    *old = *c;
+                    continue;
+                }
+#endif
+                mark_damage(_ctx, damage, x);
+            }
+            *old = *c;
         }
+        bits[w] = 0;
     }
-    ctx->cursor_x = x;
-    ctx->cursor_y = y;
+
+    state->cleared = false;
+    state->pending = false;
+    return count;
 }
 
-static void flanterm_fb_get_cursor_pos(struct flanterm_context *_ctx, size_t *x, size_t *y) {
-    struct flanterm_fb_context *ctx = (void *)_ctx;
+// Brings the grid up to date with the pending cells and marks the cells
+// whose pixels no longer match it in damage_bits. Outside of marked cells,
+// screen row y shows grid row drawn_rows[y]; afterwards that is grid_rows[y]
+// for every row.
+static void commit_pending(struct flanterm_context *_ctx, bool plot_masked) {
+    // Screen rows that scrolled since the last flush and were not moved
+    // no longer show the grid row they are stored in, compare them against
+    // the one they do show before any of them is written back to.
+    for (size_t y = 0; y < _ctx->rows; y++) {
+        diff_scrolled_row(_ctx, y);
+    }
 
-    *x = ctx->cursor_x >= _ctx->cols ? _ctx->cols - 1 : ctx->cursor_x;
-    *y = ctx->cursor_y >= _ctx->rows ? _ctx->rows - 1 : ctx->cursor_y;
+    for (size_t y = 0; y < _ctx->rows; y++) {
+        write_back_row(_ctx, y, plot_masked);
+    }
 }
 
-static void flanterm_fb_move_character(struct flanterm_context *_ctx, size_t new_x, size_t new_y, size_t old_x, size_t old_y) {
+// Replots the cell the cursor left and draws the cursor, neither cell is
+// left to be plotted after that.
+static void update_cursor(struct flanterm_context *_ctx) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    if (old_x >= _ctx->cols || old_y >= _ctx->rows
-     || new_x >= _ctx->cols || new_y >= _ctx->rows) {
-        return;
+    if ((ctx->old_cursor_x != ctx->cursor_x || ctx->old_cursor_y != ctx->cursor_y) || _ctx->cursor_enabled == false) {
+        if (ctx->old_cursor_x < _ctx->cols && ctx->old_cursor_y < _ctx->rows) {
+            plot_char(_ctx, &ctx->grid[grid_index(_ctx, ctx->old_cursor_x, ctx->old_cursor_y)], ctx->old_cursor_x, ctx->old_cursor_y);
+            unmark_damage(_ctx, ctx->old_cursor_x, ctx->old_cursor_y);
+        }
     }
 
-    size_t i = old_x + old_y * _ctx->cols;
-
-    struct flanterm_fb_char *c;
-    struct flanterm_fb_queue_item *q = ctx->map[i];
-    if (q != NULL) {
-        c = &q->c;
-    } else {
-        c = &ctx->grid[i];
+    if (_ctx->cursor_enabled) {
+        draw_cursor(_ctx);
+        if (ctx->cursor_x < _ctx->cols && ctx->cursor_y < _ctx->rows) {
+            unmark_damage(_ctx, ctx->cursor_x, ctx->cursor_y);
+        }
     }
 
-    push_to_queue(_ctx, c, new_x, new_y);
+    ctx->old_cursor_x = ctx->cursor_x;
+    ctx->old_cursor_y = ctx->cursor_y;
 }
 
-static void flanterm_fb_set_text_fg(struct flanterm_context *_ctx, size_t fg) {
+static void flanterm_fb_double_buffer_flush(struct flanterm_context *_ctx) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    ctx->text_fg = ctx->ansi_colours[fg];
-}
+#ifndef FLANTERM_FB_DISABLE_SCROLL_COPY
+    if (ctx->scroll_copy) {
+        move_scrolled_rows(_ctx);
+    }
+#endif
 
-static void flanterm_fb_set_text_bg(struct flanterm_context *_ctx, size_t bg) {
-    struct flanterm_fb_context *ctx = (void *)_ctx;
+    commit_pending(_ctx, true);
+    update_cursor(_ctx);
+    draw_bands(_ctx, flush_band);
+    // Every marked cell was plotted.
+    ctx->damage_cells = 0;
 
-    ctx->text_bg = ctx->ansi_colours[bg];
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+    push_shadow(_ctx);
+#endif
+
+#ifdef FLANTERM_FB_ENABLE_STAGING
+    store_fence();
+#endif
 }
 
-static void flanterm_fb_set_text_fg_bright(struct flanterm_context *_ctx, size_t fg) {
+// Commits screen row y for a flush step, taking the cells it goes through
+// off *budget. Writing back grid row grid_rows[y] overwrites what a
+// screen row that scrolled away from it still shows, so that row is
+// committed first, and so on, as far as the budget goes. Where that comes
+// back around to y, as scrolling leaves rows, or if y has to be committed
+// now, the row in the way is left to be replotted in full instead.
+// drawn_at holds the screen row that shows each grid row while scrolled
+// away from it.
+static void step_commit(struct flanterm_context *_ctx, size_t *drawn_at, size_t y, size_t *budget, bool now) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    ctx->text_fg = ctx->ansi_bright_colours[fg];
-}
+    if (row_committed(_ctx, y)) {
+        return;
+    }
 
-static void flanterm_fb_set_text_bg_bright(struct flanterm_context *_ctx, size_t bg) {
-    struct flanterm_fb_context *ctx = (void *)_ctx;
+    size_t *chain = ctx->row_scratch + _ctx->rows;
+    size_t n = 0;
+    for (size_t z = y;;) {
+        chain[n++] = z;
+        size_t d = drawn_at[ctx->grid_rows[z]];
+        if (d == NO_ROW) {
+            break;
+        }
+        if (now || d == y) {
+            drawn_at[ctx->drawn_rows[d]] = NO_ROW;
+            ctx->drawn_rows[d] = NO_ROW;
+            break;
+        }
+        z = d;
+    }
 
-    ctx->text_bg = ctx->ansi_bright_colours[bg];
+    // Each row can be written back once the one after it in the chain is.
+    while (n-- > 0 && (*budget != 0 || now)) {
+        size_t z = chain[n];
+        if (ctx->drawn_rows[z] != NO_ROW) {
+            drawn_at[ctx->drawn_rows[z]] = NO_ROW;
+        }
+        size_t count = diff_scrolled_row(_ctx, z);
+        count += write_back_row(_ctx, z, false);
+        *budget -= count < *budget ? count : *budget;
+    }
 }
 
-static void flanterm_fb_set_text_fg_rgb(struct flanterm_context *_ctx, uint32_t fg) {
+// Commits and plots screen rows y0 to y1 - 1 within *budget.
+static void step_rows(struct flanterm_context *_ctx, size_t *drawn_at, size_t y0, size_t y1, size_t *budget) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    ctx->text_fg = convert_colour(_ctx, fg);
+    for (size_t y = y0; y < y1 && *budget != 0; y++) {
+        step_commit(_ctx, drawn_at, y, budget, false);
+    }
+
+    if (ctx->damage_cells != 0 && *budget != 0) {
+        size_t before = *budget;
+        plot_damage_rows(_ctx, y0, y1, budget);
+        ctx->damage_cells -= before - *budget;
+    }
 }
 
-static void flanterm_fb_set_text_bg_rgb(struct flanterm_context *_ctx, uint32_t bg) {
+// Like a flush, but commits and plots rows until about max_cells cells
+// were gone through, the rows of the cursor and the priority rows first,
+// and leaves the rest for later steps. Copying scrolled rows and masked
+// plotting are left out, as their cost is not bounded by the cells plotted.
+static bool flanterm_fb_flush_step(struct flanterm_context *_ctx, size_t max_cells) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    ctx->text_bg = convert_colour(_ctx, bg);
-}
+    size_t *drawn_at = ctx->row_scratch;
+    for (size_t row = 0; row < _ctx->rows; row++) {
+        drawn_at[row] = NO_ROW;
+    }
+    for (size_t y = 0; y < _ctx->rows; y++) {
+        size_t drawn = ctx->drawn_rows[y];
+        if (drawn != NO_ROW && drawn != ctx->grid_rows[y]) {
+            drawn_at[drawn] = y;
+        }
+    }
 
-static void flanterm_fb_set_text_fg_default(struct flanterm_context *_ctx) {
-    struct flanterm_fb_context *ctx = (void *)_ctx;
+    // The cursor is drawn over what its rows hold once committed.
+    size_t budget = max_cells;
+    if (ctx->old_cursor_x < _ctx->cols && ctx->old_cursor_y < _ctx->rows) {
+        step_commit(_ctx, drawn_at, ctx->old_cursor_y, &budget, true);
+    }
+    if (ctx->cursor_x < _ctx->cols && ctx->cursor_y < _ctx->rows) {
+        step_commit(_ctx, drawn_at, ctx->cursor_y, &budget, true);
+    }
+    update_cursor(_ctx);
 
-    ctx->text_fg = ctx->default_fg;
-}
+    size_t top = _ctx->flush_priority_top;
+    size_t bottom = _ctx->flush_priority_bottom < _ctx->rows ? _ctx->flush_priority_bottom : _ctx->rows;
+    if (top < bottom) {
+        step_rows(_ctx, drawn_at, top, bottom, &budget);
+    }
+    for (size_t y0 = 0; y0 < _ctx->rows && budget != 0; y0 += ctx->tile_rows) {
+        size_t y1 = y0 + ctx->tile_rows < _ctx->rows ? y0 + ctx->tile_rows : _ctx->rows;
+        step_rows(_ctx, drawn_at, y0, y1, &budget);
+    }
 
-static void flanterm_fb_set_text_bg_default(struct flanterm_context *_ctx) {
-    struct flanterm_fb_context *ctx = (void *)_ctx;
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+    push_shadow(_ctx);
+#endif
 
-    ctx->text_bg = 0xffffffff;
+#ifdef FLANTERM_FB_ENABLE_STAGING
+    store_fence();
+#endif
+
+    if (ctx->damage_cells != 0) {
+        return true;
+    }
+    for (size_t y = 0; y < _ctx->rows; y++) {
+        if (!row_committed(_ctx, y)) {
+            return true;
+        }
+    }
+    return false;
 }
 
-static void flanterm_fb_set_text_fg_default_bright(struct flanterm_context *_ctx) {
+static inline bool can_wrap(struct flanterm_context *_ctx) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    ctx->text_fg = ctx->default_fg_bright;
+    return ctx->cursor_x >= _ctx->cols && (ctx->cursor_y < _ctx->scroll_bottom_margin - 1 || _ctx->scroll_enabled);
 }
 
-static void flanterm_fb_set_text_bg_default_bright(struct flanterm_context *_ctx) {
+static void wrap_cursor(struct flanterm_context *_ctx) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    ctx->text_bg = ctx->default_bg_bright;
+    ctx->cursor_x = 0;
+    ctx->cursor_y++;
+    if (ctx->cursor_y == _ctx->scroll_bottom_margin) {
+        ctx->cursor_y--;
+        flanterm_fb_scroll(_ctx, _ctx->scroll_top_margin, _ctx->scroll_bottom_margin, 1);
+    }
+    if (ctx->cursor_y >= _ctx->cols) {
+        ctx->cursor_y = _ctx->cols - 1;
+    }
 }
 
-static void draw_cursor(struct flanterm_context *_ctx) {
+static void flanterm_fb_raw_putchar(struct flanterm_context *_ctx, uint8_t c) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    if (ctx->cursor_x >= _ctx->cols || ctx->cursor_y >= _ctx->rows) {
-        return;
+    if (can_wrap(_ctx)) {
+        wrap_cursor(_ctx);
     }
 
-    size_t i = ctx->cursor_x + ctx->cursor_y * _ctx->cols;
-
-    struct flanterm_fb_char c;
-    struct flanterm_fb_queue_item *q = ctx->map[i];
-    if (q != NULL) {
-        c = q->c;
-    } else {
-        c = ctx->grid[i];
-    }
-    uint32_t tmp = c.fg;
-    c.fg = c.bg;
-    c.bg = tmp;
-    plot_char(_ctx, &c, ctx->cursor_x, ctx->cursor_y);
-    if (q != NULL) {
-        ctx->grid[i] = q->c;
-        ctx->map[i] = NULL;
-    }
+    struct flanterm_fb_char ch;
+    make_char(_ctx, &ch, c);
+    push_char(_ctx, &ch, ctx->cursor_x++, ctx->cursor_y);
 }
 
-static void flanterm_fb_double_buffer_flush(struct flanterm_context *_ctx) {
+static void flanterm_fb_raw_putchars(struct flanterm_context *_ctx, const uint8_t *s, size_t count) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    if (_ctx->cursor_enabled) {
-        draw_cursor(_ctx);
-    }
+    struct flanterm_fb_char ch;
 
-    for (size_t i = 0; i < ctx->queue_i; i++) {
-        struct flanterm_fb_queue_item *q = &ctx->queue[i];
-        size_t offset = q->y * _ctx->cols + q->x;
-        if (ctx->map[offset] == NULL) {
-            continue;
-        }
-        #ifdef FLANTERM_FB_ENABLE_MASKING
-            struct flanterm_fb_char *old = &ctx->grid[offset];
-            if (q->c.bg == old->bg && q->c.fg == old->fg) {
-                plot_char_masked(_ctx, old, &q->c, q->x, q->y);
-            } else {
-                plot_char(_ctx, &q->c, q->x, q->y);
+    while (count != 0) {
+        if (ctx->cursor_x >= _ctx->cols) {
+            if (!can_wrap(_ctx)) {
+                // Nowhere to wrap to, the rest falls off the end of the line.
+                ctx->cursor_x += count;
+                return;
             }
-        #else
-            plot_char(_ctx, &q->c, q->x, q->y);
-        #endif
-        ctx->grid[offset] = q->c;
-        ctx->map[offset] = NULL;
-    }
+            wrap_cursor(_ctx);
+        }
 
-    if ((ctx->old_cursor_x != ctx->cursor_x || ctx->old_cursor_y != ctx->cursor_y) || _ctx->cursor_enabled == false) {
-        if (ctx->old_cursor_x < _ctx->cols && ctx->old_cursor_y < _ctx->rows) {
-            plot_char(_ctx, &ctx->grid[ctx->old_cursor_x + ctx->old_cursor_y * _ctx->cols], ctx->old_cursor_x, ctx->old_cursor_y);
+        // Print up to the end of the current row in one go.
+        size_t n = _ctx->cols - ctx->cursor_x;
+        if (n > count) {
+            n = count;
         }
-    }
 
-    ctx->old_cursor_x = ctx->cursor_x;
-    ctx->old_cursor_y = ctx->cursor_y;
+        for (size_t i = 0; i < n; i++) {
+            make_char(_ctx, &ch, s[i]);
+            push_char(_ctx, &ch, ctx->cursor_x + i, ctx->cursor_y);
+        }
 
-    ctx->queue_i = 0;
+        ctx->cursor_x += n;
+        s += n;
+        count -= n;
+    }
 }
 
-static void flanterm_fb_raw_putchar(struct flanterm_context *_ctx, uint8_t c) {
+// Fills framebuffer lines y0 to y1 - 1 with the canvas or background.
+static void refresh_lines(struct flanterm_context *_ctx, size_t y0, size_t y1) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    if (ctx->cursor_x >= _ctx->cols && (ctx->cursor_y < _ctx->scroll_bottom_margin - 1 || _ctx->scroll_enabled)) {
-        ctx->cursor_x = 0;
-        ctx->cursor_y++;
-        if (ctx->cursor_y == _ctx->scroll_bottom_margin) {
-            ctx->cursor_y--;
-            flanterm_fb_scroll(_ctx);
-        }
-        if (ctx->cursor_y >= _ctx->cols) {
-            ctx->cursor_y = _ctx->cols - 1;
-        }
+    // Without padding between the lines of the framebuffer they are filled
+    // in one go.
+    size_t lines = y1 - y0;
+    size_t line_size = ctx->width;
+    if (ctx->pitch == ctx->width * sizeof(uint32_t) && lines != 0) {
+        line_size *= lines;
+        lines = 1;
     }
 
-    struct flanterm_fb_char ch;
-    ch.c  = c;
-    ch.fg = ctx->text_fg;
-    ch.bg = ctx->text_bg;
-    push_to_queue(_ctx, &ch, ctx->cursor_x++, ctx->cursor_y);
+    for (size_t y = y0; y < y0 + lines; y++) {
+        volatile uint32_t *fb_line = ctx->framebuffer + y * (ctx->pitch / sizeof(uint32_t));
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+        memcpy((void *)(uintptr_t)fb_line, &ctx->canvas[y * ctx->width], line_size * sizeof(uint32_t));
+#else
+        fill_line(fb_line, ctx->default_bg, line_size);
+#endif
+    }
 }
 
-static void flanterm_fb_full_refresh(struct flanterm_context *_ctx) {
+static void refresh_band(struct flanterm_context *_ctx, size_t band) {
     struct flanterm_fb_context *ctx = (void *)_ctx;
 
-#ifdef FLANTERM_FB_DISABLE_CANVAS
-    uint32_t default_bg = ctx->default_bg;
-#endif
+    size_t y0 = band * ctx->tile_rows;
+    size_t y1 = y0 + ctx->tile_rows < _ctx->rows ? y0 + ctx->tile_rows : _ctx->rows;
 
-    for (size_t y = 0; y < ctx->height; y++) {
-        for (size_t x = 0; x < ctx->width; x++) {
-#ifndef FLANTERM_FB_DISABLE_CANVAS
-            ctx->framebuffer[y * (ctx->pitch / sizeof(uint32_t)) + x] = ctx->canvas[y * ctx->width + x];
-#else
-            ctx->framebuffer[y * (ctx->pitch / sizeof(uint32_t)) + x] = default_bg;
-#endif
-        }
+    refresh_lines(_ctx, ctx->offset_y + y0 * ctx->glyph_height, ctx->offset_y + y1 * ctx->glyph_height);
+
+    for (size_t y = y0; y < y1; y++) {
+        plot_span(_ctx, &ctx->grid[grid_index(_ctx, 0, y)], 0, y, _ctx->cols);
+        ctx->drawn_rows[y] = ctx->grid_rows[y];
     }
+}
+
+static void flanterm_fb_full_refresh(struct flanterm_context *_ctx) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
 
-    for (size_t i = 0; i < (size_t)_ctx->rows * _ctx->cols; i++) {
-        size_t x = i % _ctx->cols;
-        size_t y = i / _ctx->cols;
+    // The margins above and below the rows, the bands do the rest.
+    size_t rows_end = ctx->offset_y + _ctx->rows * ctx->glyph_height;
+    refresh_lines(_ctx, 0, ctx->offset_y);
+    refresh_lines(_ctx, rows_end, ctx->height);
 
-        plot_char(_ctx, &ctx->grid[i], x, y);
-    }
+    draw_bands(_ctx, refresh_band);
+    memset(ctx->damage_bits, 0, _ctx->rows * ctx->pending_words * sizeof(uint64_t));
+    ctx->damage_cells = 0;
 
     if (_ctx->cursor_enabled) {
         draw_cursor(_ctx);
     }
+
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+    ctx->shadow_all_dirty = true;
+    push_shadow(_ctx);
+#endif
+
+#ifdef FLANTERM_FB_ENABLE_STAGING
+    store_fence();
+#endif
 }
 
 static void flanterm_fb_deinit(struct flanterm_context *_ctx, void (*_free)(void *, size_t)) {
@@ -851,10 +2465,20 @@ static void flanterm_fb_deinit(struct flanterm_context *_ctx, void (*_free)(void
     }
 
     _free(ctx->font_bits, ctx->font_bits_size);
-    _free(ctx->font_bool, ctx->font_bool_size);
     _free(ctx->grid, ctx->grid_size);
-    _free(ctx->queue, ctx->queue_size);
-    _free(ctx->map, ctx->map_size);
+    _free(ctx->pending, ctx->pending_size);
+    _free(ctx->pending_bits, ctx->pending_bits_size);
+    _free(ctx->grid_rows, ctx->grid_rows_size);
+    _free(ctx->row_state, ctx->row_state_size);
+
+#ifdef FLANTERM_FB_ENABLE_STAGING
+    _free(ctx->staging, ctx->staging_size);
+#endif
+
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+    _free(ctx->shadow, ctx->shadow_size);
+    _free(ctx->dirty, ctx->dirty_size);
+#endif
 
 #ifndef FLANTERM_FB_DISABLE_CANVAS
     _free(ctx->canvas, ctx->canvas_size);
@@ -975,6 +2599,15 @@ struct flanterm_context *flanterm_fb_init(
     ctx->text_fg = ctx->default_fg;
     ctx->text_bg = 0xffffffff;
 
+#ifdef FLANTERM_FB_ENABLE_COMPACT_CELLS
+    ctx->colours[0] = 0xffffffff;
+    ctx->colours_live[0] = 1;
+    ctx->colours_used[0] = 1;
+    ctx->colours_count = 1;
+    ctx->colours_collect_at = FLANTERM_FB_COLOURS * 3 / 4;
+#endif
+    update_text_colours(_ctx);
+
     ctx->framebuffer = (void *)framebuffer;
     ctx->width = width;
     ctx->height = height;
@@ -1005,49 +2638,57 @@ struct flanterm_context *flanterm_fb_init(
 
 #undef FONT_BYTES
 
-    ctx->font_width += font_spacing;
-
-    ctx->font_bool_size = FLANTERM_FB_FONT_GLYPHS * font_height * ctx->font_width * sizeof(bool);
-    ctx->font_bool = _malloc(ctx->font_bool_size);
-    if (ctx->font_bool == NULL) {
-        goto fail;
-    }
-
     for (size_t i = 0; i < FLANTERM_FB_FONT_GLYPHS; i++) {
-        uint8_t *glyph = &ctx->font_bits[i * font_height];
-
-        for (size_t y = 0; y < font_height; y++) {
-            // NOTE: the characters in VGA fonts are always one byte wide.
-            // 9 dot wide fonts have 8 dots and one empty column, except
-            // characters 0xC0-0xDF replicate column 9.
-            for (size_t x = 0; x < 8; x++) {
-                size_t offset = i * font_height * ctx->font_width + y * ctx->font_width + x;
-
-                if ((glyph[y] & (0x80 >> x))) {
-                    ctx->font_bool[offset] = true;
-                } else {
-                    ctx->font_bool[offset] = false;
-                }
-            }
-            // fill columns above 8 like VGA Line Graphics Mode does
-            for (size_t x = 8; x < ctx->font_width; x++) {
-                size_t offset = i * font_height * ctx->font_width + y * ctx->font_width + x;
-
-                if (i >= 0xc0 && i <= 0xdf) {
-                    ctx->font_bool[offset] = (glyph[y] & 1);
-                } else {
-                    ctx->font_bool[offset] = false;
-                }
+        ctx->blank_glyphs[i] = true;
+        for (size_t j = 0; j < font_height; j++) {
+            if (ctx->font_bits[i * font_height + j] != 0) {
+                ctx->blank_glyphs[i] = false;
+                break;
             }
         }
     }
 
+    ctx->font_width += font_spacing;
+
     ctx->font_scale_x = font_scale_x;
     ctx->font_scale_y = font_scale_y;
 
     ctx->glyph_width = ctx->font_width * font_scale_x;
     ctx->glyph_height = font_height * font_scale_y;
 
+    ctx->plot_char_opaque = plot_char_opaque;
+    ctx->plot_span_cells = plot_span_cells;
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+    ctx->plot_char_canvas = plot_char_canvas;
+#endif
+#ifndef FLANTERM_FB_DISABLE_GLYPH_KERNELS
+    if (ctx->font_width == 9 && ctx->font_height == 16 && font_scale_x == font_scale_y) {
+        switch (font_scale_x) {
+            case 1:
+                ctx->plot_char_opaque = plot_char_opaque_9x16_1;
+                ctx->plot_span_cells = plot_span_cells_9x16_1;
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+                ctx->plot_char_canvas = plot_char_canvas_9x16_1;
+#endif
+                break;
+            case 2:
+                ctx->plot_char_opaque = plot_char_opaque_9x16_2;
+                ctx->plot_span_cells = plot_span_cells_9x16_2;
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+                ctx->plot_char_canvas = plot_char_canvas_9x16_2;
+#endif
+                break;
+            case 4:
+                ctx->plot_char_opaque = plot_char_opaque_9x16_4;
+                ctx->plot_span_cells = plot_span_cells_9x16_4;
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+                ctx->plot_char_canvas = plot_char_canvas_9x16_4;
+#endif
+                break;
+        }
+    }
+#endif
+
     _ctx->cols = (ctx->width - margin * 2) / ctx->glyph_width;
     _ctx->rows = (ctx->height - margin * 2) / ctx->glyph_height;
 
@@ -1060,25 +2701,84 @@ struct flanterm_context *flanterm_fb_init(
         goto fail;
     }
     for (size_t i = 0; i < _ctx->rows * _ctx->cols; i++) {
-        ctx->grid[i].c = ' ';
-        ctx->grid[i].fg = ctx->text_fg;
-        ctx->grid[i].bg = ctx->text_bg;
+        make_char(_ctx, &ctx->grid[i], ' ');
+    }
+
+    ctx->pending_size = _ctx->rows * _ctx->cols * sizeof(struct flanterm_fb_char);
+    ctx->pending = _malloc(ctx->pending_size);
+    if (ctx->pending == NULL) {
+        goto fail;
+    }
+
+    ctx->pending_words = (_ctx->cols + 63) / 64;
+    ctx->pending_bits_size = _ctx->rows * 2 * ctx->pending_words * sizeof(uint64_t);
+    ctx->pending_bits = _malloc(ctx->pending_bits_size);
+    if (ctx->pending_bits == NULL) {
+        goto fail;
     }
+    memset(ctx->pending_bits, 0, ctx->pending_bits_size);
+    ctx->damage_bits = ctx->pending_bits + _ctx->rows * ctx->pending_words;
+    ctx->damage_cells = 0;
 
-    ctx->queue_size = _ctx->rows * _ctx->cols * sizeof(struct flanterm_fb_queue_item);
-    ctx->queue = _malloc(ctx->queue_size);
-    if (ctx->queue == NULL) {
+    ctx->tile_cols = FLANTERM_FB_TILE_WIDTH / ctx->glyph_width;
+    if (ctx->tile_cols == 0) {
+        ctx->tile_cols = 1;
+    }
+    ctx->tile_rows = FLANTERM_FB_TILE_HEIGHT / ctx->glyph_height;
+    if (ctx->tile_rows == 0) {
+        ctx->tile_rows = 1;
+    }
+
+    ctx->grid_rows_size = _ctx->rows * 4 * sizeof(size_t);
+    ctx->grid_rows = _malloc(ctx->grid_rows_size);
+    if (ctx->grid_rows == NULL) {
+        goto fail;
+    }
+    ctx->drawn_rows = ctx->grid_rows + _ctx->rows;
+    ctx->row_scratch = ctx->drawn_rows + _ctx->rows;
+    for (size_t i = 0; i < _ctx->rows; i++) {
+        ctx->grid_rows[i] = i;
+        ctx->drawn_rows[i] = i;
+    }
+
+    ctx->row_state_size = _ctx->rows * sizeof(struct flanterm_fb_row_state);
+    ctx->row_state = _malloc(ctx->row_state_size);
+    if (ctx->row_state == NULL) {
+        goto fail;
+    }
+    memset(ctx->row_state, 0, ctx->row_state_size);
+
+#ifdef FLANTERM_FB_ENABLE_STAGING
+    ctx->staging_size = FLANTERM_FB_SPAN_CELLS * ctx->glyph_width * sizeof(uint32_t);
+    ctx->staging = _malloc(ctx->staging_size);
+    if (ctx->staging == NULL) {
+        goto fail;
+    }
+#endif
+
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+    ctx->shadow_size = ctx->width * ctx->height * sizeof(uint32_t);
+    ctx->shadow = _malloc(ctx->shadow_size);
+    if (ctx->shadow == NULL) {
         goto fail;
     }
-    ctx->queue_i = 0;
-    memset(ctx->queue, 0, ctx->queue_size);
 
-    ctx->map_size = _ctx->rows * _ctx->cols * sizeof(struct flanterm_fb_queue_item *);
-    ctx->map = _malloc(ctx->map_size);
-    if (ctx->map == NULL) {
+    ctx->dirty_size = _ctx->rows * sizeof(struct flanterm_fb_dirty_span);
+    ctx->dirty = _malloc(ctx->dirty_size);
+    if (ctx->dirty == NULL) {
         goto fail;
     }
-    memset(ctx->map, 0, ctx->map_size);
+    for (size_t i = 0; i < _ctx->rows; i++) {
+        ctx->dirty[i].start = SIZE_MAX;
+        ctx->dirty[i].end = 0;
+    }
+
+    // Everything is drawn to the shadow framebuffer from here on.
+    ctx->front_framebuffer = ctx->framebuffer;
+    ctx->front_pitch = ctx->pitch;
+    ctx->framebuffer = ctx->shadow;
+    ctx->pitch = ctx->width * sizeof(uint32_t);
+#endif
 
 #ifndef FLANTERM_FB_DISABLE_CANVAS
     ctx->canvas_size = ctx->width * ctx->height * sizeof(uint32_t);
@@ -1097,8 +2797,30 @@ struct flanterm_context *flanterm_fb_init(
     }
 #endif
 
+#ifndef FLANTERM_FB_DISABLE_SCROLL_COPY
+    // Copying pixel rows also copies the canvas behind cells with the default
+    // background, which is only right if every pixel row of the canvas under
+    // the text looks the same.
+    ctx->scroll_copy = true;
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+    size_t text_width = _ctx->cols * ctx->glyph_width;
+    uint32_t *first_line = ctx->canvas + ctx->offset_y * ctx->width + ctx->offset_x;
+    for (size_t y = 1; y < _ctx->rows * ctx->glyph_height && ctx->scroll_copy; y++) {
+        uint32_t *line = first_line + y * ctx->width;
+        for (size_t x = 0; x < text_width; x++) {
+            if (line[x] != first_line[x]) {
+                ctx->scroll_copy = false;
+                break;
+            }
+        }
+    }
+#endif
+#endif
+
     _ctx->raw_putchar = flanterm_fb_raw_putchar;
+    _ctx->raw_putchars = flanterm_fb_raw_putchars;
     _ctx->clear = flanterm_fb_clear;
+    _ctx->fill_region = flanterm_fb_fill_region;
     _ctx->set_cursor_pos = flanterm_fb_set_cursor_pos;
     _ctx->get_cursor_pos = flanterm_fb_get_cursor_pos;
     _ctx->set_text_fg = flanterm_fb_set_text_fg;
@@ -1112,16 +2834,18 @@ struct flanterm_context *flanterm_fb_init(
     _ctx->set_text_fg_default_bright = flanterm_fb_set_text_fg_default_bright;
     _ctx->set_text_bg_default_bright = flanterm_fb_set_text_bg_default_bright;
     _ctx->move_character = flanterm_fb_move_character;
+    _ctx->move_span = flanterm_fb_move_span;
     _ctx->scroll = flanterm_fb_scroll;
     _ctx->revscroll = flanterm_fb_revscroll;
     _ctx->swap_palette = flanterm_fb_swap_palette;
     _ctx->save_state = flanterm_fb_save_state;
     _ctx->restore_state = flanterm_fb_restore_state;
     _ctx->double_buffer_flush = flanterm_fb_double_buffer_flush;
+    _ctx->flush_step = flanterm_fb_flush_step;
     _ctx->full_refresh = flanterm_fb_full_refresh;
     _ctx->deinit = flanterm_fb_deinit;
 
-    flanterm_context_reinit(_ctx);
+    flanterm_context_init(_ctx);
     flanterm_fb_full_refresh(_ctx);
 
     return _ctx;
@@ -1143,18 +2867,34 @@ fail:
         _free(ctx->canvas, ctx->canvas_size);
     }
 #endif
-    if (ctx->map != NULL) {
-        _free(ctx->map, ctx->map_size);
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+    if (ctx->dirty != NULL) {
+        _free(ctx->dirty, ctx->dirty_size);
     }
-    if (ctx->queue != NULL) {
-        _free(ctx->queue, ctx->queue_size);
+    if (ctx->shadow != NULL) {
+        _free(ctx->shadow, ctx->shadow_size);
+    }
+#endif
+#ifdef FLANTERM_FB_ENABLE_STAGING
+    if (ctx->staging != NULL) {
+        _free(ctx->staging, ctx->staging_size);
+    }
+#endif
+    if (ctx->row_state != NULL) {
+        _free(ctx->row_state, ctx->row_state_size);
+    }
+    if (ctx->grid_rows != NULL) {
+        _free(ctx->grid_rows, ctx->grid_rows_size);
+    }
+    if (ctx->pending_bits != NULL) {
+        _free(ctx->pending_bits, ctx->pending_bits_size);
+    }
+    if (ctx->pending != NULL) {
+        _free(ctx->pending, ctx->pending_size);
     }
     if (ctx->grid != NULL) {
         _free(ctx->grid, ctx->grid_size);
     }
-    if (ctx->font_bool != NULL) {
-        _free(ctx->font_bool, ctx->font_bool_size);
-    }
     if (ctx->font_bits != NULL) {
         _free(ctx->font_bits, ctx->font_bits_size);
     }
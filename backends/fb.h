@@ -38,17 +38,40 @@ extern "C" {
 
 #define FLANTERM_FB_FONT_GLYPHS 256
 
+#ifdef FLANTERM_FB_ENABLE_COMPACT_CELLS
+// Cells refer to their colours by index into a table of this many entries,
+// so at most this many distinct colours can be on screen at once.
+#define FLANTERM_FB_COLOURS 4096
+
+// The glyph in bits 0-7, the foreground colour index in bits 8-19 and the
+// background colour index in bits 20-31.
+struct flanterm_fb_char {
+    uint32_t v;
+};
+#else
 struct flanterm_fb_char {
     uint32_t c;
     uint32_t fg;
     uint32_t bg;
 };
+#endif
 
-struct flanterm_fb_queue_item {
-    size_t x, y;
-    struct flanterm_fb_char c;
+// Clearing a row only records the blank it was cleared to, the cells are
+// filled in by the next flush. Cells written before the clear are dropped
+// by clearing their pending bits. pending is set once any of them is set.
+struct flanterm_fb_row_state {
+    bool cleared;
+    bool pending;
+    struct flanterm_fb_char blank;
 };
 
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+// The cells start to end - 1 of a screen row, empty if start >= end.
+struct flanterm_fb_dirty_span {
+    size_t start, end;
+};
+#endif
+
 struct flanterm_fb_context {
     struct flanterm_context term;
 
@@ -62,6 +85,16 @@ struct flanterm_fb_context {
 
     size_t offset_x, offset_y;
 
+    // Draw a glyph with solid colours, or with the canvas showing through,
+    // at pixel position x, y. Picked at init for the font geometry.
+    void (*plot_char_opaque)(struct flanterm_context *, uint32_t c, uint32_t fg, uint32_t bg, size_t x, size_t y);
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+    void (*plot_char_canvas)(struct flanterm_context *, uint32_t c, uint32_t fg, uint32_t bg, size_t x, size_t y);
+#endif
+    // Draw count cells side by side at pixel position x, y, count being at
+    // most FLANTERM_FB_SPAN_CELLS.
+    void (*plot_span_cells)(struct flanterm_context *, struct flanterm_fb_char *cells, size_t count, size_t x, size_t y);
+
     volatile uint32_t *framebuffer;
     size_t pitch;
     size_t width;
@@ -76,8 +109,12 @@ struct flanterm_fb_context {
 
     size_t font_bits_size;
     uint8_t *font_bits;
-    size_t font_bool_size;
-    bool *font_bool;
+    // Glyphs with no pixels set, drawn as just their background.
+    bool blank_glyphs[FLANTERM_FB_FONT_GLYPHS];
+
+    // The pixels each nibble of a glyph row expands to in the colours below.
+    uint32_t nibble_lut[16][4];
+    uint32_t nibble_lut_fg, nibble_lut_bg;
 
     uint32_t ansi_colours[8];
     uint32_t ansi_bright_colours[8];
@@ -90,15 +127,71 @@ struct flanterm_fb_context {
 #endif
 
     size_t grid_size;
-    size_t queue_size;
-    size_t map_size;
+    size_t pending_size;
+    size_t pending_bits_size;
+    size_t grid_rows_size;
+    size_t row_state_size;
 
     struct flanterm_fb_char *grid;
 
-    struct flanterm_fb_queue_item *queue;
-    size_t queue_i;
+    // Cells written since the last flush, valid where their bit in
+    // pending_bits is set. Each row of cells has pending_words words of bits.
+    struct flanterm_fb_char *pending;
+    uint64_t *pending_bits;
+    size_t pending_words;
+    // The cells each screen row has to have replotted, set and cleared by
+    // the flush. Laid out like pending_bits, damage_cells of them are set.
+    uint64_t *damage_bits;
+    size_t damage_cells;
 
-    struct flanterm_fb_queue_item **map;
+    // The flush plots damage_bits a tile of this many cells at a time.
+    size_t tile_cols, tile_rows;
+
+    // Screen row y is stored in row grid_rows[y] of grid and pending, so
+    // that scrolling only has to rotate these row numbers. drawn_rows holds
+    // the grid row each screen row was last drawn from, or (size_t)-1 if it
+    // is to be replotted in full. row_scratch has room for 2 * rows numbers.
+    size_t *grid_rows;
+    size_t *drawn_rows;
+    size_t *row_scratch;
+
+    // Indexed by grid row.
+    struct flanterm_fb_row_state *row_state;
+
+#ifdef FLANTERM_FB_ENABLE_STAGING
+    // One pixel row of a span of up to FLANTERM_FB_SPAN_CELLS glyphs, composed
+    // here and then copied to the framebuffer with a single store_row.
+    size_t staging_size;
+    uint32_t *staging;
+#endif
+
+#ifdef FLANTERM_FB_ENABLE_SHADOW
+    // framebuffer and pitch point at shadow. Flushes copy the dirty span of
+    // each screen row from it to front_framebuffer, the real one.
+    volatile uint32_t *front_framebuffer;
+    size_t front_pitch;
+    size_t shadow_size;
+    uint32_t *shadow;
+    size_t dirty_size;
+    struct flanterm_fb_dirty_span *dirty;
+    // Set when the margins have to be copied too.
+    bool shadow_all_dirty;
+#endif
+
+#ifdef FLANTERM_FB_ENABLE_COMPACT_CELLS
+    // Found by hashing the colour and probing onwards from there. Index 0
+    // is the transparent colour 0xffffffff. Slots in colours_live hold a
+    // colour, probing stops at slots that are not in colours_used either.
+    uint32_t colours[FLANTERM_FB_COLOURS];
+    uint64_t colours_live[FLANTERM_FB_COLOURS / 64];
+    uint64_t colours_used[FLANTERM_FB_COLOURS / 64];
+    size_t colours_count;
+    // Slots whose colour no cell uses any more are freed once
+    // colours_count reaches this.
+    size_t colours_collect_at;
+    // text_fg and text_bg as the colour bits of a cell.
+    uint32_t text_colours;
+#endif
 
     uint32_t text_fg;
     uint32_t text_bg;
@@ -112,6 +205,11 @@ struct flanterm_fb_context {
 
     size_t old_cursor_x;
     size_t old_cursor_y;
+
+#ifndef FLANTERM_FB_DISABLE_SCROLL_COPY
+    // Scrolled rows are moved by copying framebuffer pixels.
+    bool scroll_copy;
+#endif
 };
 
 struct flanterm_context *flanterm_fb_init(
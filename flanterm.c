@@ -29,6 +29,8 @@
 
 #include "flanterm.h"
 
+void *memcpy(void *, const void *, size_t);
+
 // Tries to implement this standard for terminfo
 // https://man7.org/linux/man-pages/man4/console_codes.4.html
 
@@ -68,29 +70,311 @@ static const uint32_t col256[] = {
 #define CHARSET_DEFAULT 0
 #define CHARSET_DEC_SPECIAL 1
 
+// The escape sequence parser is a table driven state machine in the style of
+// https://vt100.net/emu/dec_ansi_parser
+// Every byte is first mapped to a class, then parser_table[state][class]
+// yields the action to perform and the state to move to.
+
+#define STATE_GROUND 0
+#define STATE_ESCAPE 1
+#define STATE_CSI_INTRO 2   // swallows the byte following an 8-bit CSI
+#define STATE_CSI_ENTRY 3
+#define STATE_CSI_PARAM 4
+#define STATE_CSI_DIGITS 5  // inside of a numeric parameter
+#define STATE_OSC 6
+#define STATE_OSC_ESCAPE 7
+#define STATE_CHARSET 8
+#define STATE_DISCARD 9     // drops the next byte, after ESC [ [
+
+#define CLASS_CONTROL 0
+#define CLASS_BEL 1
+#define CLASS_CANCEL 2
+#define CLASS_ESC 3
+#define CLASS_PRINT 4
+#define CLASS_DIGIT 5
+#define CLASS_SEMICOLON 6
+#define CLASS_QUESTION 7
+#define CLASS_PAREN 8
+#define CLASS_LBRACKET 9
+#define CLASS_RBRACKET 10
+#define CLASS_BACKSLASH 11
+#define CLASS_CSI 12
+#define CLASS_HIGH 13
+#define CLASS_UTF8 14
+#define CLASS_COUNT 15
+
+#define ACTION_NONE 0
+#define ACTION_PRINT 1
+#define ACTION_EXECUTE 2
+#define ACTION_UTF8 3
+#define ACTION_ESC_DISPATCH 4
+#define ACTION_CHARSET_SELECT 5
+#define ACTION_CHARSET 6
+#define ACTION_CSI_CLEAR 7
+#define ACTION_DEC_PRIVATE 8
+#define ACTION_PARAM 9
+#define ACTION_PARAM_EMPTY 10
+#define ACTION_PARAM_END 11
+#define ACTION_CSI_DISPATCH 12
+#define ACTION_PARAM_END_CSI_DISPATCH 13
+
+// Spelled out rather than with range designators to stay standard C.
+static const uint8_t byte_class[256] = {
+    /* 0x00 */ CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_BEL,
+    /* 0x08 */ CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL,
+    /* 0x10 */ CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL,
+    /* 0x18 */ CLASS_CANCEL, CLASS_CONTROL, CLASS_CANCEL, CLASS_ESC, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL, CLASS_CONTROL,
+    /* 0x20 */ CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT,
+    /* 0x28 */ CLASS_PAREN, CLASS_PAREN, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT,
+    /* 0x30 */ CLASS_DIGIT, CLASS_DIGIT, CLASS_DIGIT, CLASS_DIGIT, CLASS_DIGIT, CLASS_DIGIT, CLASS_DIGIT, CLASS_DIGIT,
+    /* 0x38 */ CLASS_DIGIT, CLASS_DIGIT, CLASS_PRINT, CLASS_SEMICOLON, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_QUESTION,
+    /* 0x40 */ CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT,
+    /* 0x48 */ CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT,
+    /* 0x50 */ CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT,
+    /* 0x58 */ CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_LBRACKET, CLASS_BACKSLASH, CLASS_RBRACKET, CLASS_PRINT, CLASS_PRINT,
+    /* 0x60 */ CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT,
+    /* 0x68 */ CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT,
+    /* 0x70 */ CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT,
+    /* 0x78 */ CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_PRINT, CLASS_CONTROL,
+    /* 0x80 */ CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH,
+    /* 0x88 */ CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH,
+    /* 0x90 */ CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH,
+    /* 0x98 */ CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_CSI, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH,
+    /* 0xa0 */ CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH,
+    /* 0xa8 */ CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH,
+    /* 0xb0 */ CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH,
+    /* 0xb8 */ CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH,
+    /* 0xc0 */ CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8,
+    /* 0xc8 */ CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8,
+    /* 0xd0 */ CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8,
+    /* 0xd8 */ CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8,
+    /* 0xe0 */ CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8,
+    /* 0xe8 */ CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8,
+    /* 0xf0 */ CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8, CLASS_UTF8,
+    /* 0xf8 */ CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH, CLASS_HIGH,
+};
+
+#define T(ACTION, STATE) (((ACTION) << 4) | (STATE))
+
+// UTF-8 lead bytes are decoded independently of the escape sequence state,
+// hence ACTION_UTF8 never changes state.
+static const uint8_t parser_table[][CLASS_COUNT] = {
+    [STATE_GROUND] = {
+        [CLASS_CONTROL] = T(ACTION_EXECUTE, STATE_GROUND),
+        [CLASS_BEL] = T(ACTION_EXECUTE, STATE_GROUND),
+        [CLASS_CANCEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_ESC] = T(ACTION_NONE, STATE_ESCAPE),
+        [CLASS_PRINT] = T(ACTION_PRINT, STATE_GROUND),
+        [CLASS_DIGIT] = T(ACTION_PRINT, STATE_GROUND),
+        [CLASS_SEMICOLON] = T(ACTION_PRINT, STATE_GROUND),
+        [CLASS_QUESTION] = T(ACTION_PRINT, STATE_GROUND),
+        [CLASS_PAREN] = T(ACTION_PRINT, STATE_GROUND),
+        [CLASS_LBRACKET] = T(ACTION_PRINT, STATE_GROUND),
+        [CLASS_RBRACKET] = T(ACTION_PRINT, STATE_GROUND),
+        [CLASS_BACKSLASH] = T(ACTION_PRINT, STATE_GROUND),
+        [CLASS_CSI] = T(ACTION_NONE, STATE_CSI_INTRO),
+        [CLASS_HIGH] = T(ACTION_EXECUTE, STATE_GROUND),
+        [CLASS_UTF8] = T(ACTION_UTF8, STATE_GROUND),
+    },
+    [STATE_ESCAPE] = {
+        [CLASS_CONTROL] = T(ACTION_ESC_DISPATCH, STATE_GROUND),
+        [CLASS_BEL] = T(ACTION_ESC_DISPATCH, STATE_GROUND),
+        [CLASS_CANCEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_ESC] = T(ACTION_ESC_DISPATCH, STATE_GROUND),
+        [CLASS_PRINT] = T(ACTION_ESC_DISPATCH, STATE_GROUND),
+        [CLASS_DIGIT] = T(ACTION_ESC_DISPATCH, STATE_GROUND),
+        [CLASS_SEMICOLON] = T(ACTION_ESC_DISPATCH, STATE_GROUND),
+        [CLASS_QUESTION] = T(ACTION_ESC_DISPATCH, STATE_GROUND),
+        [CLASS_PAREN] = T(ACTION_CHARSET_SELECT, STATE_CHARSET),
+        [CLASS_LBRACKET] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_RBRACKET] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_BACKSLASH] = T(ACTION_ESC_DISPATCH, STATE_GROUND),
+        [CLASS_CSI] = T(ACTION_ESC_DISPATCH, STATE_GROUND),
+        [CLASS_HIGH] = T(ACTION_ESC_DISPATCH, STATE_GROUND),
+        [CLASS_UTF8] = T(ACTION_UTF8, STATE_ESCAPE),
+    },
+    [STATE_CSI_INTRO] = {
+        [CLASS_CONTROL] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_BEL] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_CANCEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_ESC] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_PRINT] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_DIGIT] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_SEMICOLON] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_QUESTION] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_PAREN] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_LBRACKET] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_RBRACKET] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_BACKSLASH] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_CSI] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_HIGH] = T(ACTION_CSI_CLEAR, STATE_CSI_ENTRY),
+        [CLASS_UTF8] = T(ACTION_UTF8, STATE_CSI_INTRO),
+    },
+    [STATE_CSI_ENTRY] = {
+        [CLASS_CONTROL] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_BEL] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_CANCEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_ESC] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_PRINT] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_DIGIT] = T(ACTION_PARAM, STATE_CSI_DIGITS),
+        [CLASS_SEMICOLON] = T(ACTION_PARAM_EMPTY, STATE_CSI_PARAM),
+        [CLASS_QUESTION] = T(ACTION_DEC_PRIVATE, STATE_CSI_PARAM),
+        [CLASS_PAREN] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_LBRACKET] = T(ACTION_NONE, STATE_DISCARD),
+        [CLASS_RBRACKET] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_BACKSLASH] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_CSI] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_HIGH] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_UTF8] = T(ACTION_UTF8, STATE_CSI_ENTRY),
+    },
+    [STATE_CSI_PARAM] = {
+        [CLASS_CONTROL] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_BEL] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_CANCEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_ESC] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_PRINT] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_DIGIT] = T(ACTION_PARAM, STATE_CSI_DIGITS),
+        [CLASS_SEMICOLON] = T(ACTION_PARAM_EMPTY, STATE_CSI_PARAM),
+        [CLASS_QUESTION] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_PAREN] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_LBRACKET] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_RBRACKET] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_BACKSLASH] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_CSI] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_HIGH] = T(ACTION_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_UTF8] = T(ACTION_UTF8, STATE_CSI_PARAM),
+    },
+    [STATE_CSI_DIGITS] = {
+        [CLASS_CONTROL] = T(ACTION_PARAM_END_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_BEL] = T(ACTION_PARAM_END_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_CANCEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_ESC] = T(ACTION_PARAM_END_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_PRINT] = T(ACTION_PARAM_END_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_DIGIT] = T(ACTION_PARAM, STATE_CSI_DIGITS),
+        [CLASS_SEMICOLON] = T(ACTION_PARAM_END, STATE_CSI_PARAM),
+        [CLASS_QUESTION] = T(ACTION_PARAM_END_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_PAREN] = T(ACTION_PARAM_END_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_LBRACKET] = T(ACTION_PARAM_END_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_RBRACKET] = T(ACTION_PARAM_END_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_BACKSLASH] = T(ACTION_PARAM_END_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_CSI] = T(ACTION_PARAM_END_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_HIGH] = T(ACTION_PARAM_END_CSI_DISPATCH, STATE_GROUND),
+        [CLASS_UTF8] = T(ACTION_UTF8, STATE_CSI_DIGITS),
+    },
+    [STATE_OSC] = {
+        [CLASS_CONTROL] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_BEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_CANCEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_ESC] = T(ACTION_NONE, STATE_OSC_ESCAPE),
+        [CLASS_PRINT] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_DIGIT] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_SEMICOLON] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_QUESTION] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_PAREN] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_LBRACKET] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_RBRACKET] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_BACKSLASH] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_CSI] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_HIGH] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_UTF8] = T(ACTION_UTF8, STATE_OSC),
+    },
+    [STATE_OSC_ESCAPE] = {
+        [CLASS_CONTROL] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_BEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_CANCEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_ESC] = T(ACTION_NONE, STATE_OSC_ESCAPE),
+        [CLASS_PRINT] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_DIGIT] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_SEMICOLON] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_QUESTION] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_PAREN] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_LBRACKET] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_RBRACKET] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_BACKSLASH] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_CSI] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_HIGH] = T(ACTION_NONE, STATE_OSC),
+        [CLASS_UTF8] = T(ACTION_UTF8, STATE_OSC_ESCAPE),
+    },
+    [STATE_CHARSET] = {
+        [CLASS_CONTROL] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_BEL] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_CANCEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_ESC] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_PRINT] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_DIGIT] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_SEMICOLON] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_QUESTION] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_PAREN] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_LBRACKET] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_RBRACKET] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_BACKSLASH] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_CSI] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_HIGH] = T(ACTION_CHARSET, STATE_GROUND),
+        [CLASS_UTF8] = T(ACTION_UTF8, STATE_CHARSET),
+    },
+    [STATE_DISCARD] = {
+        [CLASS_CONTROL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_BEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_CANCEL] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_ESC] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_PRINT] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_DIGIT] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_SEMICOLON] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_QUESTION] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_PAREN] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_LBRACKET] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_RBRACKET] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_BACKSLASH] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_CSI] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_HIGH] = T(ACTION_NONE, STATE_GROUND),
+        [CLASS_UTF8] = T(ACTION_NONE, STATE_GROUND),
+    },
+};
+
+#undef T
+
+void flanterm_context_init(struct flanterm_context *ctx) {
+    ctx->async_ring = NULL;
+    ctx->async_ring_size = 0;
+    ctx->async_head = 0;
+    ctx->async_tail = 0;
+    ctx->async_dropped = 0;
+    ctx->async_sleeping = false;
+    ctx->async_stop = false;
+    ctx->async_wait = NULL;
+    ctx->async_notify = NULL;
+    ctx->producers = NULL;
+    ctx->flush_policy_set = false;
+    ctx->flush_policy = (struct flanterm_flush_policy){0};
+    ctx->unflushed_bytes = 0;
+    ctx->unflushed_cells = 0;
+    ctx->unflushed_newline = false;
+    ctx->last_flush_time = 0;
+    ctx->flush_stats = (struct flanterm_flush_stats){0};
+
+    flanterm_context_reinit(ctx);
+}
+
 void flanterm_context_reinit(struct flanterm_context *ctx) {
     ctx->tab_size = 8;
-    ctx->autoflush = true;
+    // A flush policy is up to the client, RIS keeps it.
+    if (!ctx->flush_policy_set) {
+        ctx->autoflush = true;
+    }
     ctx->cursor_enabled = true;
     ctx->scroll_enabled = true;
-    ctx->control_sequence = false;
-    ctx->csi = false;
-    ctx->escape = false;
-    ctx->osc = false;
-    ctx->osc_escape = false;
-    ctx->rrr = false;
-    ctx->discard_next = false;
+    ctx->parser_state = STATE_GROUND;
     ctx->bold = false;
     ctx->bg_bold = false;
     ctx->reverse_video = false;
     ctx->dec_private = false;
     ctx->insert_mode = false;
     ctx->unicode_remaining = 0;
+    ctx->last_printed = 0;
     ctx->g_select = 0;
     ctx->charsets[0] = CHARSET_DEFAULT;
     ctx->charsets[1] = CHARSET_DEC_SPECIAL;
     ctx->current_charset = 0;
-    ctx->escape_offset = 0;
     ctx->esc_values_i = 0;
     ctx->saved_cursor_x = 0;
     ctx->saved_cursor_y = 0;
@@ -101,18 +385,383 @@ void flanterm_context_reinit(struct flanterm_context *ctx) {
     ctx->oob_output = FLANTERM_OOB_OUTPUT_ONLCR;
 }
 
-static void flanterm_putchar(struct flanterm_context *ctx, uint8_t c);
+static void flanterm_parse(struct flanterm_context *ctx, const uint8_t *buf, size_t count);
 
-void flanterm_write(struct flanterm_context *ctx, const char *buf, size_t count) {
-    for (size_t i = 0; i < count; i++) {
-        flanterm_putchar(ctx, buf[i]);
+#define FLANTERM_ONES 0x0101010101010101ULL
+#define FLANTERM_HIGHS 0x8080808080808080ULL
+
+// Returns the length of the run of printable ASCII characters (0x20-0x7e)
+// at the start of buf. Scans 8 bytes at a time while it can.
+static size_t flanterm_printable_run(const uint8_t *buf, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        uint64_t w;
+        __builtin_memcpy(&w, &buf[i], 8);
+
+        // With the top bits masked off no byte can carry into the next one.
+        uint64_t low = w & ~FLANTERM_HIGHS;
+        uint64_t ge_20 = low + (0x80 - 0x20) * FLANTERM_ONES;
+        uint64_t ge_7f = low + (0x80 - 0x7f) * FLANTERM_ONES;
+        if (((ge_20 & ~ge_7f & ~w) & FLANTERM_HIGHS) != FLANTERM_HIGHS) {
+            break;
+        }
+    }
+
+    while (i < count && buf[i] >= 0x20 && buf[i] <= 0x7e) {
+        i++;
+    }
+
+    return i;
+}
+
+#undef FLANTERM_HIGHS
+#undef FLANTERM_ONES
+
+// Rings are filled by one thread and parsed by another. head and tail count
+// the bytes ever written to and read from a ring of size bytes, a power of
+// two.
+static void ring_copy(uint8_t *ring, size_t size, size_t head, const uint8_t *buf, size_t count) {
+    size_t offset = head & (size - 1);
+    size_t first = size - offset;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(&ring[offset], buf, first);
+    memcpy(ring, buf + first, count - first);
+}
+
+// Parses the bytes from *tail up to head, handing the space back to the
+// writer as it goes.
+static void ring_parse(struct flanterm_context *ctx, const uint8_t *ring, size_t size, size_t *tail, size_t head) {
+    size_t t = *tail;
+
+    while (t != head) {
+        size_t offset = t & (size - 1);
+        size_t count = size - offset;
+        if (count > head - t) {
+            count = head - t;
+        }
+        flanterm_parse(ctx, &ring[offset], count);
+        t += count;
+        __atomic_store_n(tail, t, __ATOMIC_RELEASE);
+    }
+}
+
+// Wakes up the renderer if it is waiting, after something was made visible
+// to it by a sequentially consistent store. Together with the renderer's
+// store to async_sleeping and its loads after that, either the writer sees
+// the renderer going to sleep, or the renderer sees what was written.
+static void async_wake(struct flanterm_context *ctx) {
+    if (__atomic_exchange_n(&ctx->async_sleeping, false, __ATOMIC_SEQ_CST)) {
+        ctx->async_notify(ctx);
+    }
+}
+
+// Only the writer stores async_head and only the renderer async_tail.
+static void async_write(struct flanterm_context *ctx, const uint8_t *buf, size_t count) {
+    size_t head = ctx->async_head;
+    size_t tail = __atomic_load_n(&ctx->async_tail, __ATOMIC_ACQUIRE);
+
+    if (count > ctx->async_ring_size - (head - tail)) {
+        __atomic_fetch_add(&ctx->async_dropped, count, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ring_copy(ctx->async_ring, ctx->async_ring_size, head, buf, count);
+    __atomic_store_n(&ctx->async_head, head + count, __ATOMIC_SEQ_CST);
+
+    async_wake(ctx);
+}
+
+// Counts a finished flush and starts counting towards the next one.
+static void flush_done(struct flanterm_context *ctx) {
+    ctx->flush_stats.flushes++;
+    ctx->unflushed_bytes = 0;
+    ctx->unflushed_cells = 0;
+    ctx->unflushed_newline = false;
+    if (ctx->flush_policy.flags & FLANTERM_FLUSH_TIME) {
+        ctx->last_flush_time = ctx->flush_policy.clock(ctx);
     }
+}
+
+void flanterm_flush(struct flanterm_context *ctx) {
+    ctx->double_buffer_flush(ctx);
+    flush_done(ctx);
+}
 
+bool flanterm_flush_step(struct flanterm_context *ctx, size_t max_cells) {
+    if (ctx->flush_step == NULL) {
+        flanterm_flush(ctx);
+        return false;
+    }
+
+    if (ctx->flush_step(ctx, max_cells)) {
+        return true;
+    }
+    flush_done(ctx);
+    return false;
+}
+
+void flanterm_set_flush_policy(struct flanterm_context *ctx, const struct flanterm_flush_policy *policy) {
+    ctx->autoflush = false;
+    ctx->flush_policy_set = true;
+    ctx->flush_policy = *policy;
+    if (policy->clock == NULL) {
+        ctx->flush_policy.flags &= ~FLANTERM_FLUSH_TIME;
+    }
+    if (ctx->flush_policy.flags & FLANTERM_FLUSH_TIME) {
+        ctx->last_flush_time = policy->clock(ctx);
+    }
+}
+
+// Called after bytes were parsed.
+static void maybe_flush(struct flanterm_context *ctx) {
     if (ctx->autoflush) {
-        ctx->double_buffer_flush(ctx);
+        flanterm_flush(ctx);
+        return;
+    }
+
+    struct flanterm_flush_policy *policy = &ctx->flush_policy;
+    if (policy->flags == 0 || ctx->unflushed_bytes == 0) {
+        return;
+    }
+
+    if (((policy->flags & FLANTERM_FLUSH_NEWLINE) && ctx->unflushed_newline)
+     || ((policy->flags & FLANTERM_FLUSH_BYTES) && ctx->unflushed_bytes >= policy->bytes)
+     || ((policy->flags & FLANTERM_FLUSH_CELLS) && ctx->unflushed_cells >= policy->cells)
+     || ((policy->flags & FLANTERM_FLUSH_TIME) && policy->clock(ctx) - ctx->last_flush_time >= policy->interval)) {
+        flanterm_flush(ctx);
+    }
+}
+
+void flanterm_write(struct flanterm_context *ctx, const char *buf, size_t count) {
+    if (ctx->async_ring != NULL) {
+        async_write(ctx, (const uint8_t *)buf, count);
+        return;
+    }
+
+    flanterm_parse(ctx, (const uint8_t *)buf, count);
+    ctx->flush_stats.writes++;
+    maybe_flush(ctx);
+}
+
+// Without a renderer there is nobody to wake, flanterm_merge() is polled.
+static void producer_wake(struct flanterm_context *ctx) {
+    if (__atomic_load_n(&ctx->async_ring, __ATOMIC_ACQUIRE) != NULL) {
+        async_wake(ctx);
+    }
+}
+
+bool flanterm_producer_init(struct flanterm_context *ctx, struct flanterm_producer *producer, void *ring, size_t size) {
+    if (size == 0 || (size & (size - 1)) != 0) {
+        return false;
+    }
+
+    producer->ctx = ctx;
+    producer->ring = ring;
+    producer->ring_size = size;
+    producer->head = 0;
+    producer->published = 0;
+    producer->tail = 0;
+    producer->dropped = 0;
+    producer->discarding = false;
+
+    producer->next = __atomic_load_n(&ctx->producers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&ctx->producers, &producer->next, producer,
+                                        true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+
+    return true;
+}
+
+// Only the producer's thread stores head and published, only the merger
+// stores tail. Bytes past published belong to a line that is not complete
+// yet.
+void flanterm_produce(struct flanterm_producer *producer, const char *buf, size_t count) {
+    const uint8_t *s = (const uint8_t *)buf;
+
+    // The start of the current line was dropped, drop the rest of it too.
+    if (producer->discarding) {
+        size_t i = 0;
+        while (i < count && s[i] != '\n') {
+            i++;
+        }
+        if (i == count) {
+            __atomic_fetch_add(&producer->dropped, count, __ATOMIC_RELAXED);
+            return;
+        }
+        __atomic_fetch_add(&producer->dropped, i + 1, __ATOMIC_RELAXED);
+        s += i + 1;
+        count -= i + 1;
+        producer->discarding = false;
+    }
+
+    if (count == 0) {
+        return;
+    }
+
+    size_t head = producer->head;
+    size_t tail = __atomic_load_n(&producer->tail, __ATOMIC_ACQUIRE);
+
+    // Drop the write along with the start of its first line, and if it ends
+    // in the middle of a line, the rest of that line.
+    if (count > producer->ring_size - (head - tail)) {
+        __atomic_fetch_add(&producer->dropped, head - producer->published + count, __ATOMIC_RELAXED);
+        producer->head = producer->published;
+        producer->discarding = s[count - 1] != '\n';
+        return;
+    }
+
+    ring_copy(producer->ring, producer->ring_size, head, s, count);
+    producer->head = head + count;
+
+    size_t end = count;
+    while (end > 0 && s[end - 1] != '\n') {
+        end--;
+    }
+    if (end == 0) {
+        return;
+    }
+
+    __atomic_store_n(&producer->published, head + end, __ATOMIC_SEQ_CST);
+    producer_wake(producer->ctx);
+}
+
+void flanterm_producer_flush(struct flanterm_producer *producer) {
+    if (producer->published == producer->head) {
+        return;
+    }
+
+    __atomic_store_n(&producer->published, producer->head, __ATOMIC_SEQ_CST);
+    producer_wake(producer->ctx);
+}
+
+size_t flanterm_producer_dropped(struct flanterm_producer *producer) {
+    return __atomic_load_n(&producer->dropped, __ATOMIC_RELAXED);
+}
+
+// Parses what each producer has published, a producer at a time so that its
+// lines go in whole. Returns false if there was nothing.
+static bool merge_producers(struct flanterm_context *ctx) {
+    bool merged = false;
+
+    struct flanterm_producer *producer = __atomic_load_n(&ctx->producers, __ATOMIC_ACQUIRE);
+    for (; producer != NULL; producer = producer->next) {
+        size_t published = __atomic_load_n(&producer->published, __ATOMIC_ACQUIRE);
+        if (published == producer->tail) {
+            continue;
+        }
+        ring_parse(ctx, producer->ring, producer->ring_size, &producer->tail, published);
+        ctx->flush_stats.writes++;
+        merged = true;
+    }
+
+    return merged;
+}
+
+bool flanterm_merge(struct flanterm_context *ctx) {
+    if (!merge_producers(ctx)) {
+        return false;
+    }
+
+    maybe_flush(ctx);
+    return true;
+}
+
+bool flanterm_async_init(struct flanterm_context *ctx, void *ring, size_t size,
+                         void (*wait)(struct flanterm_context *),
+                         void (*notify)(struct flanterm_context *)) {
+    if (size == 0 || (size & (size - 1)) != 0) {
+        return false;
+    }
+    if (wait == NULL || notify == NULL) {
+        return false;
+    }
+
+    ctx->async_ring_size = size;
+    ctx->async_head = 0;
+    ctx->async_tail = 0;
+    ctx->async_dropped = 0;
+    ctx->async_sleeping = false;
+    ctx->async_stop = false;
+    ctx->async_wait = wait;
+    ctx->async_notify = notify;
+    __atomic_store_n(&ctx->async_ring, (uint8_t *)ring, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+// Parses everything in the ring and published by producers at the time of
+// the call, flushing once at the end. Returns false if there was nothing.
+static bool async_drain(struct flanterm_context *ctx) {
+    bool drained = false;
+
+    size_t head = __atomic_load_n(&ctx->async_head, __ATOMIC_ACQUIRE);
+    if (head != ctx->async_tail) {
+        ring_parse(ctx, ctx->async_ring, ctx->async_ring_size, &ctx->async_tail, head);
+        ctx->flush_stats.writes++;
+        drained = true;
+    }
+
+    if (merge_producers(ctx)) {
+        drained = true;
+    }
+
+    if (drained) {
+        maybe_flush(ctx);
+    }
+
+    return drained;
+}
+
+static bool async_pending(struct flanterm_context *ctx) {
+    if (__atomic_load_n(&ctx->async_head, __ATOMIC_SEQ_CST) != ctx->async_tail) {
+        return true;
+    }
+
+    struct flanterm_producer *producer = __atomic_load_n(&ctx->producers, __ATOMIC_ACQUIRE);
+    for (; producer != NULL; producer = producer->next) {
+        if (__atomic_load_n(&producer->published, __ATOMIC_SEQ_CST) != producer->tail) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void flanterm_async_run(struct flanterm_context *ctx) {
+    for (;;) {
+        if (async_drain(ctx)) {
+            continue;
+        }
+
+        // Writes that came before the stop are seen once it is.
+        __atomic_store_n(&ctx->async_sleeping, true, __ATOMIC_SEQ_CST);
+        bool stop = __atomic_load_n(&ctx->async_stop, __ATOMIC_SEQ_CST);
+        if (async_pending(ctx)) {
+            __atomic_store_n(&ctx->async_sleeping, false, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (stop) {
+            __atomic_store_n(&ctx->async_sleeping, false, __ATOMIC_RELAXED);
+            return;
+        }
+
+        ctx->async_wait(ctx);
+        __atomic_store_n(&ctx->async_sleeping, false, __ATOMIC_RELAXED);
     }
 }
 
+void flanterm_async_stop(struct flanterm_context *ctx) {
+    __atomic_store_n(&ctx->async_stop, true, __ATOMIC_SEQ_CST);
+    ctx->async_notify(ctx);
+}
+
+size_t flanterm_async_dropped(struct flanterm_context *ctx) {
+    return __atomic_load_n(&ctx->async_dropped, __ATOMIC_RELAXED);
+}
+
 static void sgr(struct flanterm_context *ctx) {
     size_t i = 0;
 
@@ -452,65 +1101,52 @@ static void mode_toggle(struct flanterm_context *ctx, uint8_t c) {
     }
 }
 
-static void osc_parse(struct flanterm_context *ctx, uint8_t c) {
-    if (ctx->osc_escape && c == '\\') {
-        goto cleanup;
+// Moves len cells of row y from column src_x to column dst_x, the spans may
+// overlap.
+static void move_cells(struct flanterm_context *ctx, size_t y, size_t dst_x, size_t src_x, size_t len) {
+    if (len == 0 || dst_x == src_x) {
+        return;
     }
 
-    ctx->osc_escape = false;
-
-    switch (c) {
-        case 0x1b:
-            ctx->osc_escape = true;
-            break;
-        case '\a':
-            goto cleanup;
+    if (ctx->move_span != NULL) {
+        ctx->move_span(ctx, y, dst_x, src_x, len);
+        return;
     }
 
-    return;
-
-cleanup:
-    ctx->osc_escape = false;
-    ctx->osc = false;
-    ctx->escape = false;
+    if (dst_x > src_x) {
+        for (size_t i = len; i-- > 0;) {
+            ctx->move_character(ctx, dst_x + i, y, src_x + i, y);
+        }
+    } else {
+        for (size_t i = 0; i < len; i++) {
+            ctx->move_character(ctx, dst_x + i, y, src_x + i, y);
+        }
+    }
 }
 
-static void control_sequence_parse(struct flanterm_context *ctx, uint8_t c) {
-    if (ctx->escape_offset == 2) {
-        switch (c) {
-            case '[':
-                ctx->discard_next = true;
-                goto cleanup;
-            case '?':
-                ctx->dec_private = true;
-                return;
-        }
+// Blanks the cells from column x0 to x1 - 1 of rows y0 to y1 - 1, the cursor
+// is left anywhere.
+static void erase_region(struct flanterm_context *ctx, size_t x0, size_t y0, size_t x1, size_t y1) {
+    if (x0 >= x1 || y0 >= y1) {
+        return;
     }
 
-    if (c >= '0' && c <= '9') {
-        if (ctx->esc_values_i == FLANTERM_MAX_ESC_VALUES) {
-            return;
-        }
-        ctx->rrr = true;
-        ctx->esc_values[ctx->esc_values_i] *= 10;
-        ctx->esc_values[ctx->esc_values_i] += c - '0';
+    if (ctx->fill_region != NULL) {
+        ctx->fill_region(ctx, x0, y0, x1, y1, ' ');
         return;
     }
 
-    if (ctx->rrr == true) {
-        ctx->esc_values_i++;
-        ctx->rrr = false;
-        if (c == ';')
-            return;
-    } else if (c == ';') {
-        if (ctx->esc_values_i == FLANTERM_MAX_ESC_VALUES) {
-            return;
+    for (size_t y = y0; y < y1; y++) {
+        ctx->set_cursor_pos(ctx, x0, y);
+        for (size_t x = x0; x < x1; x++) {
+            ctx->raw_putchar(ctx, ' ');
         }
-        ctx->esc_values[ctx->esc_values_i] = 0;
-        ctx->esc_values_i++;
-        return;
     }
+}
+
+static void repeat_last_printed(struct flanterm_context *ctx, size_t count);
 
+static void control_sequence_parse(struct flanterm_context *ctx, uint8_t c) {
     size_t esc_default;
     switch (c) {
         case 'J': case 'K': case 'q':
@@ -525,7 +1161,13 @@ static void control_sequence_parse(struct flanterm_context *ctx, uint8_t c) {
 
     if (ctx->dec_private == true) {
         dec_private_parse(ctx, c);
-        goto cleanup;
+        return;
+    }
+
+    // REP prints like text does, so it has to be able to scroll.
+    if (c == 'b') {
+        repeat_last_printed(ctx, ctx->esc_values[0]);
+        return;
     }
 
     bool r = ctx->scroll_enabled;
@@ -617,19 +1259,27 @@ static void control_sequence_parse(struct flanterm_context *ctx, uint8_t c) {
             ctx->set_cursor_pos(ctx, ctx->esc_values[1], ctx->esc_values[0]);
             break;
         case 'M':
-            for (size_t i = 0; i < ctx->esc_values[0]; i++) {
-                ctx->scroll(ctx);
+            if (ctx->esc_values[0] != 0) {
+                ctx->scroll(ctx, ctx->scroll_top_margin, ctx->scroll_bottom_margin, ctx->esc_values[0]);
             }
             break;
-        case 'L': {
-            size_t old_scroll_top_margin = ctx->scroll_top_margin;
-            ctx->scroll_top_margin = y;
-            for (size_t i = 0; i < ctx->esc_values[0]; i++) {
-                ctx->revscroll(ctx);
+        case 'L':
+            if (ctx->esc_values[0] != 0) {
+                // Below the scrolling region only the cursor line is cleared.
+                ctx->revscroll(ctx, y, y < ctx->scroll_bottom_margin ? ctx->scroll_bottom_margin : y + 1,
+                               ctx->esc_values[0]);
+            }
+            break;
+        case 'S':
+            if (ctx->esc_values[0] != 0) {
+                ctx->scroll(ctx, ctx->scroll_top_margin, ctx->scroll_bottom_margin, ctx->esc_values[0]);
+            }
+            break;
+        case 'T':
+            if (ctx->esc_values[0] != 0) {
+                ctx->revscroll(ctx, ctx->scroll_top_margin, ctx->scroll_bottom_margin, ctx->esc_values[0]);
             }
-            ctx->scroll_top_margin = old_scroll_top_margin;
             break;
-        }
         case 'n':
             switch (ctx->esc_values[0]) {
                 case 5:
@@ -651,33 +1301,16 @@ static void control_sequence_parse(struct flanterm_context *ctx, uint8_t c) {
             break;
         case 'J':
             switch (ctx->esc_values[0]) {
-                case 0: {
-                    size_t rows_remaining = ctx->rows - (y + 1);
-                    size_t cols_diff = ctx->cols - (x + 1);
-                    size_t to_clear = rows_remaining * ctx->cols + cols_diff + 1;
-                    for (size_t i = 0; i < to_clear; i++) {
-                        ctx->raw_putchar(ctx, ' ');
-                    }
+                case 0:
+                    erase_region(ctx, x, y, ctx->cols, y + 1);
+                    erase_region(ctx, 0, y + 1, ctx->cols, ctx->rows);
                     ctx->set_cursor_pos(ctx, x, y);
                     break;
-                }
-                case 1: {
-                    ctx->set_cursor_pos(ctx, 0, 0);
-                    bool b = false;
-                    for (size_t yc = 0; yc < ctx->rows; yc++) {
-                        for (size_t xc = 0; xc < ctx->cols; xc++) {
-                            ctx->raw_putchar(ctx, ' ');
-                            if (xc == x && yc == y) {
-                                ctx->set_cursor_pos(ctx, x, y);
-                                b = true;
-                                break;
-                            }
-                        }
-                        if (b == true)
-                            break;
-                    }
+                case 1:
+                    erase_region(ctx, 0, 0, ctx->cols, y);
+                    erase_region(ctx, 0, y, x + 1, y + 1);
+                    ctx->set_cursor_pos(ctx, x, y);
                     break;
-                }
                 case 2:
                 case 3:
                     ctx->clear(ctx, false);
@@ -685,24 +1318,21 @@ static void control_sequence_parse(struct flanterm_context *ctx, uint8_t c) {
             }
             break;
         case '@':
-            for (size_t i = ctx->cols - 1; ; i--) {
-                ctx->move_character(ctx, i + ctx->esc_values[0], y, i, y);
-                ctx->set_cursor_pos(ctx, i, y);
-                ctx->raw_putchar(ctx, ' ');
-                if (i == x) {
-                    break;
-                }
+            if (ctx->esc_values[0] < ctx->cols - x) {
+                move_cells(ctx, y, x + ctx->esc_values[0], x, ctx->cols - x - ctx->esc_values[0]);
             }
+            erase_region(ctx, x, y, ctx->esc_values[0] < ctx->cols - x ? x + ctx->esc_values[0] : ctx->cols, y + 1);
             ctx->set_cursor_pos(ctx, x, y);
             break;
         case 'P':
-            for (size_t i = x + ctx->esc_values[0]; i < ctx->cols; i++)
-                ctx->move_character(ctx, i - ctx->esc_values[0], y, i, y);
-            ctx->set_cursor_pos(ctx, ctx->cols - ctx->esc_values[0], y);
-            // FALLTHRU
+            if (ctx->esc_values[0] < ctx->cols - x) {
+                move_cells(ctx, y, x, x + ctx->esc_values[0], ctx->cols - x - ctx->esc_values[0]);
+            }
+            erase_region(ctx, ctx->esc_values[0] < ctx->cols - x ? ctx->cols - ctx->esc_values[0] : x, y, ctx->cols, y + 1);
+            ctx->set_cursor_pos(ctx, x, y);
+            break;
         case 'X':
-            for (size_t i = 0; i < ctx->esc_values[0]; i++)
-                ctx->raw_putchar(ctx, ' ');
+            erase_region(ctx, x, y, ctx->esc_values[0] < ctx->cols - x ? x + ctx->esc_values[0] : ctx->cols, y + 1);
             ctx->set_cursor_pos(ctx, x, y);
             break;
         case 'm':
@@ -716,25 +1346,18 @@ static void control_sequence_parse(struct flanterm_context *ctx, uint8_t c) {
             break;
         case 'K':
             switch (ctx->esc_values[0]) {
-                case 0: {
-                    for (size_t i = x; i < ctx->cols; i++)
-                        ctx->raw_putchar(ctx, ' ');
+                case 0:
+                    erase_region(ctx, x, y, ctx->cols, y + 1);
                     ctx->set_cursor_pos(ctx, x, y);
                     break;
-                }
-                case 1: {
-                    ctx->set_cursor_pos(ctx, 0, y);
-                    for (size_t i = 0; i < x; i++)
-                        ctx->raw_putchar(ctx, ' ');
+                case 1:
+                    erase_region(ctx, 0, y, x, y + 1);
+                    ctx->set_cursor_pos(ctx, x, y);
                     break;
-                }
-                case 2: {
-                    ctx->set_cursor_pos(ctx, 0, y);
-                    for (size_t i = 0; i < ctx->cols; i++)
-                        ctx->raw_putchar(ctx, ' ');
+                case 2:
+                    erase_region(ctx, 0, y, ctx->cols, y + 1);
                     ctx->set_cursor_pos(ctx, x, y);
                     break;
-                }
             }
             break;
         case 'r':
@@ -770,10 +1393,6 @@ static void control_sequence_parse(struct flanterm_context *ctx, uint8_t c) {
     }
 
     ctx->scroll_enabled = r;
-
-cleanup:
-    ctx->control_sequence = false;
-    ctx->escape = false;
 }
 
 static void restore_state(struct flanterm_context *ctx) {
@@ -799,39 +1418,10 @@ static void save_state(struct flanterm_context *ctx) {
 }
 
 static void escape_parse(struct flanterm_context *ctx, uint8_t c) {
-    ctx->escape_offset++;
-
-    if (ctx->osc == true) {
-        osc_parse(ctx, c);
-        return;
-    }
-
-    if (ctx->control_sequence == true) {
-        control_sequence_parse(ctx, c);
-        return;
-    }
-
-    if (ctx->csi == true) {
-        ctx->csi = false;
-        goto is_csi;
-    }
-
     size_t x, y;
     ctx->get_cursor_pos(ctx, &x, &y);
 
     switch (c) {
-        case ']':
-            ctx->osc_escape = false;
-            ctx->osc = true;
-            return;
-        case '[':
-is_csi:
-            for (size_t i = 0; i < FLANTERM_MAX_ESC_VALUES; i++)
-                ctx->esc_values[i] = 0;
-            ctx->esc_values_i = 0;
-            ctx->rrr = false;
-            ctx->control_sequence = true;
-            return;
         case '7':
             save_state(ctx);
             break;
@@ -844,7 +1434,7 @@ is_csi:
             break;
         case 'D':
             if (y == ctx->scroll_bottom_margin - 1) {
-                ctx->scroll(ctx);
+                ctx->scroll(ctx, ctx->scroll_top_margin, ctx->scroll_bottom_margin, 1);
                 ctx->set_cursor_pos(ctx, x, y);
             } else {
                 ctx->set_cursor_pos(ctx, x, y + 1);
@@ -852,7 +1442,7 @@ is_csi:
             break;
         case 'E':
             if (y == ctx->scroll_bottom_margin - 1) {
-                ctx->scroll(ctx);
+                ctx->scroll(ctx, ctx->scroll_top_margin, ctx->scroll_bottom_margin, 1);
                 ctx->set_cursor_pos(ctx, 0, y);
             } else {
                 ctx->set_cursor_pos(ctx, 0, y + 1);
@@ -861,7 +1451,7 @@ is_csi:
         case 'M':
             // "Reverse linefeed"
             if (y == ctx->scroll_top_margin) {
-                ctx->revscroll(ctx);
+                ctx->revscroll(ctx, ctx->scroll_top_margin, ctx->scroll_bottom_margin, 1);
                 ctx->set_cursor_pos(ctx, 0, y);
             } else {
                 ctx->set_cursor_pos(ctx, 0, y - 1);
@@ -872,13 +1462,7 @@ is_csi:
                 ctx->callback(ctx, FLANTERM_CB_PRIVATE_ID, 0, 0, 0);
             }
             break;
-        case '(':
-        case ')':
-            ctx->g_select = c - '\'';
-            break;
     }
-
-    ctx->escape = false;
 }
 
 static bool dec_special_print(struct flanterm_context *ctx, uint8_t c) {
@@ -918,359 +1502,413 @@ static bool dec_special_print(struct flanterm_context *ctx, uint8_t c) {
     return false;
 }
 
-// Following wcwidth related code inherited from:
+// Unicode lookup tables. The width data was generated from the combining
+// character intervals and wide character ranges of:
 // https://www.cl.cam.ac.uk/~mgk25/ucs/wcwidth.c
+//
+// Widths are looked up in 3 levels: unicode_width_top is indexed by
+// code_point >> 12 and selects a block of 32 entries in unicode_width_mid,
+// which in turn is indexed by bits 7-11 and selects a leaf of 128 2-bit
+// widths in unicode_width_leaves. Identical blocks and leaves are shared.
+
+static const uint8_t unicode_width_top[] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x05, 0x04,
+    0x04, 0x06, 0x07, 0x08, 0x09, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x0a, 0x07, 0x07, 0x04, 0x04, 0x04, 0x04,
+    0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0b,
+    0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+    0x04, 0x04, 0x04, 0x0b, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x0c, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07
+};
 
-struct interval {
-    uint32_t first;
-    uint32_t last;
+static const uint8_t unicode_width_mid[] = {
+    0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x02, 0x01, 0x01, 0x03, 0x01, 0x04,
+    0x05, 0x06, 0x07, 0x08, 0x01, 0x01, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x01, 0x18, 0x19,
+    0x01, 0x01, 0x1a, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x1b, 0x1c,
+    0x1d, 0x1e, 0x1f, 0x01, 0x20, 0x01, 0x21, 0x01, 0x01, 0x01, 0x01, 0x22,
+    0x01, 0x01, 0x01, 0x01, 0x23, 0x24, 0x01, 0x01, 0x01, 0x01, 0x25, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x26, 0x26, 0x26,
+    0x27, 0x28, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26,
+    0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26,
+    0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26,
+    0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26,
+    0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26,
+    0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26,
+    0x26, 0x29, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x2a, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26,
+    0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26,
+    0x26, 0x26, 0x26, 0x2b, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x26, 0x26,
+    0x26, 0x26, 0x2c, 0x01, 0x01, 0x01, 0x01, 0x01, 0x2d, 0x2e, 0x2f, 0x30,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x31, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x32, 0x33,
+    0x34, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26,
+    0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26,
+    0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x35,
+    0x36, 0x01, 0x19, 0x02, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01
 };
 
-/* auxiliary function for binary search in interval table */
-static int bisearch(uint32_t ucs, const struct interval *table, int max) {
-  int min = 0;
-  int mid;
-
-  if (ucs < table[0].first || ucs > table[max].last)
-    return 0;
-  while (max >= min) {
-    mid = (min + max) / 2;
-    if (ucs > table[mid].last)
-      min = mid + 1;
-    else if (ucs < table[mid].first)
-      max = mid - 1;
-    else
-      return 1;
-  }
-
-  return 0;
-}
+static const uint8_t unicode_width_leaves[] = {
+    0x54, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x55, 0x55, 0x55, 0x55,
+    0x15, 0x40, 0x50, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10,
+    0x41, 0x10, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x00, 0x55, 0x55, 0x55, 0x00, 0x50, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x15, 0x00,
+    0x00, 0x00, 0x00, 0x40, 0x55, 0x55, 0x55, 0x55, 0x54, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x05, 0x00, 0x00,
+    0x00, 0x14, 0x04, 0x50, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x15,
+    0x51, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x40, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x05, 0x00, 0x00, 0x54, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x15, 0x00, 0x00, 0x55, 0x55, 0x55,
+    0x41, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x54, 0x01, 0x00, 0x54, 0x51, 0x01, 0x54, 0x55, 0x55,
+    0x05, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x51, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x54,
+    0x01, 0x54, 0x55, 0x51, 0x55, 0x55, 0x55, 0x55, 0x05, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x41, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x54, 0x41, 0x15, 0x14, 0x50,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x50, 0x55, 0x55, 0x55,
+    0x41, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x54, 0x01, 0x10, 0x54, 0x51, 0x55, 0x55, 0x55, 0x55,
+    0x05, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x51, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x14,
+    0x01, 0x55, 0x55, 0x51, 0x55, 0x45, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x45, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x54, 0x55, 0x55, 0x51,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x05, 0x54, 0x05, 0x04, 0x50, 0x55, 0x41, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x14,
+    0x55, 0x45, 0x55, 0x50, 0x55, 0x55, 0x55, 0x55, 0x05, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x01, 0x55, 0x55, 0x51,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x45, 0x55, 0x05, 0x44, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x51, 0x00, 0x40, 0x55,
+    0x55, 0x15, 0x00, 0x40, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x51, 0x00, 0x10, 0x54, 0x55, 0x55, 0x00, 0x50,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x50, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x11, 0x51, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x01, 0x00, 0x00, 0x40, 0x00, 0x04, 0x55, 0x55,
+    0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x54,
+    0x55, 0x45, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x01, 0x44, 0x05, 0x51, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x50, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x15, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x05, 0x54, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x05, 0x54, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x05, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x05, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x10, 0x00, 0x50,
+    0x55, 0x45, 0x01, 0x00, 0x00, 0x55, 0x55, 0x51, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x15, 0x50, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x51, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x40, 0x15, 0x54, 0x55, 0x45, 0x55, 0x01, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x15, 0x54, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x00, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x04, 0x40, 0x54, 0x45, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x15, 0x00, 0x00, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x00, 0x00, 0x40, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x05, 0x55, 0x55, 0x15, 0x00, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x05, 0x40, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x00, 0x55, 0x05, 0x00, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x69, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0x0a, 0x00,
+    0xaa, 0xaa, 0xaa, 0x6a, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0x82, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x45, 0x15, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x41, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x45,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x00, 0x00, 0x00, 0x00, 0xaa, 0xaa, 0x5a, 0x55, 0x00, 0x55, 0x55, 0x55,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x15, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0x56, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0xaa, 0x6a, 0x55, 0x55, 0x55, 0x55, 0x01, 0x55, 0x01, 0x41, 0x55, 0x00,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x40, 0x15,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x15, 0x50, 0x55, 0x15, 0x00, 0x00, 0x00,
+    0x40, 0x01, 0x00, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x05, 0x50,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x05, 0x54, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0x5a,
+    0x51, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
 
-int mk_wcwidth(uint32_t ucs) {
-  /* sorted list of non-overlapping intervals of non-spacing characters */
-  /* generated by "uniset +cat=Me +cat=Mn +cat=Cf -00AD +1160-11FF +200B c" */
-  static const struct interval combining[] = {
-    { 0x0300, 0x036F }, { 0x0483, 0x0486 }, { 0x0488, 0x0489 },
-    { 0x0591, 0x05BD }, { 0x05BF, 0x05BF }, { 0x05C1, 0x05C2 },
-    { 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0600, 0x0603 },
-    { 0x0610, 0x0615 }, { 0x064B, 0x065E }, { 0x0670, 0x0670 },
-    { 0x06D6, 0x06E4 }, { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED },
-    { 0x070F, 0x070F }, { 0x0711, 0x0711 }, { 0x0730, 0x074A },
-    { 0x07A6, 0x07B0 }, { 0x07EB, 0x07F3 }, { 0x0901, 0x0902 },
-    { 0x093C, 0x093C }, { 0x0941, 0x0948 }, { 0x094D, 0x094D },
-    { 0x0951, 0x0954 }, { 0x0962, 0x0963 }, { 0x0981, 0x0981 },
-    { 0x09BC, 0x09BC }, { 0x09C1, 0x09C4 }, { 0x09CD, 0x09CD },
-    { 0x09E2, 0x09E3 }, { 0x0A01, 0x0A02 }, { 0x0A3C, 0x0A3C },
-    { 0x0A41, 0x0A42 }, { 0x0A47, 0x0A48 }, { 0x0A4B, 0x0A4D },
-    { 0x0A70, 0x0A71 }, { 0x0A81, 0x0A82 }, { 0x0ABC, 0x0ABC },
-    { 0x0AC1, 0x0AC5 }, { 0x0AC7, 0x0AC8 }, { 0x0ACD, 0x0ACD },
-    { 0x0AE2, 0x0AE3 }, { 0x0B01, 0x0B01 }, { 0x0B3C, 0x0B3C },
-    { 0x0B3F, 0x0B3F }, { 0x0B41, 0x0B43 }, { 0x0B4D, 0x0B4D },
-    { 0x0B56, 0x0B56 }, { 0x0B82, 0x0B82 }, { 0x0BC0, 0x0BC0 },
-    { 0x0BCD, 0x0BCD }, { 0x0C3E, 0x0C40 }, { 0x0C46, 0x0C48 },
-    { 0x0C4A, 0x0C4D }, { 0x0C55, 0x0C56 }, { 0x0CBC, 0x0CBC },
-    { 0x0CBF, 0x0CBF }, { 0x0CC6, 0x0CC6 }, { 0x0CCC, 0x0CCD },
-    { 0x0CE2, 0x0CE3 }, { 0x0D41, 0x0D43 }, { 0x0D4D, 0x0D4D },
-    { 0x0DCA, 0x0DCA }, { 0x0DD2, 0x0DD4 }, { 0x0DD6, 0x0DD6 },
-    { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E },
-    { 0x0EB1, 0x0EB1 }, { 0x0EB4, 0x0EB9 }, { 0x0EBB, 0x0EBC },
-    { 0x0EC8, 0x0ECD }, { 0x0F18, 0x0F19 }, { 0x0F35, 0x0F35 },
-    { 0x0F37, 0x0F37 }, { 0x0F39, 0x0F39 }, { 0x0F71, 0x0F7E },
-    { 0x0F80, 0x0F84 }, { 0x0F86, 0x0F87 }, { 0x0F90, 0x0F97 },
-    { 0x0F99, 0x0FBC }, { 0x0FC6, 0x0FC6 }, { 0x102D, 0x1030 },
-    { 0x1032, 0x1032 }, { 0x1036, 0x1037 }, { 0x1039, 0x1039 },
-    { 0x1058, 0x1059 }, { 0x1160, 0x11FF }, { 0x135F, 0x135F },
-    { 0x1712, 0x1714 }, { 0x1732, 0x1734 }, { 0x1752, 0x1753 },
-    { 0x1772, 0x1773 }, { 0x17B4, 0x17B5 }, { 0x17B7, 0x17BD },
-    { 0x17C6, 0x17C6 }, { 0x17C9, 0x17D3 }, { 0x17DD, 0x17DD },
-    { 0x180B, 0x180D }, { 0x18A9, 0x18A9 }, { 0x1920, 0x1922 },
-    { 0x1927, 0x1928 }, { 0x1932, 0x1932 }, { 0x1939, 0x193B },
-    { 0x1A17, 0x1A18 }, { 0x1B00, 0x1B03 }, { 0x1B34, 0x1B34 },
-    { 0x1B36, 0x1B3A }, { 0x1B3C, 0x1B3C }, { 0x1B42, 0x1B42 },
-    { 0x1B6B, 0x1B73 }, { 0x1DC0, 0x1DCA }, { 0x1DFE, 0x1DFF },
-    { 0x200B, 0x200F }, { 0x202A, 0x202E }, { 0x2060, 0x2063 },
-    { 0x206A, 0x206F }, { 0x20D0, 0x20EF }, { 0x302A, 0x302F },
-    { 0x3099, 0x309A }, { 0xA806, 0xA806 }, { 0xA80B, 0xA80B },
-    { 0xA825, 0xA826 }, { 0xFB1E, 0xFB1E }, { 0xFE00, 0xFE0F },
-    { 0xFE20, 0xFE23 }, { 0xFEFF, 0xFEFF }, { 0xFFF9, 0xFFFB },
-    { 0x10A01, 0x10A03 }, { 0x10A05, 0x10A06 }, { 0x10A0C, 0x10A0F },
-    { 0x10A38, 0x10A3A }, { 0x10A3F, 0x10A3F }, { 0x1D167, 0x1D169 },
-    { 0x1D173, 0x1D182 }, { 0x1D185, 0x1D18B }, { 0x1D1AA, 0x1D1AD },
-    { 0x1D242, 0x1D244 }, { 0xE0001, 0xE0001 }, { 0xE0020, 0xE007F },
-    { 0xE0100, 0xE01EF }
-  };
-
-  /* test for 8-bit control characters */
-  if (ucs == 0)
-    return 0;
-  if (ucs < 32 || (ucs >= 0x7f && ucs < 0xa0))
-    return 1;
-
-  /* binary search in table of non-spacing characters */
-  if (bisearch(ucs, combining,
-	       sizeof(combining) / sizeof(struct interval) - 1))
-    return 0;
-
-  /* if we arrive here, ucs is not a combining or C0/C1 control character */
-
-  return 1 +
-    (ucs >= 0x1100 &&
-     (ucs <= 0x115f ||                    /* Hangul Jamo init. consonants */
-      ucs == 0x2329 || ucs == 0x232a ||
-      (ucs >= 0x2e80 && ucs <= 0xa4cf &&
-       ucs != 0x303f) ||                  /* CJK ... Yi */
-      (ucs >= 0xac00 && ucs <= 0xd7a3) || /* Hangul Syllables */
-      (ucs >= 0xf900 && ucs <= 0xfaff) || /* CJK Compatibility Ideographs */
-      (ucs >= 0xfe10 && ucs <= 0xfe19) || /* Vertical forms */
-      (ucs >= 0xfe30 && ucs <= 0xfe6f) || /* CJK Compatibility Forms */
-      (ucs >= 0xff00 && ucs <= 0xff60) || /* Fullwidth Forms */
-      (ucs >= 0xffe0 && ucs <= 0xffe6) ||
-      (ucs >= 0x20000 && ucs <= 0x2fffd) ||
-      (ucs >= 0x30000 && ucs <= 0x3fffd)));
-}
+int flanterm_unicode_width(uint32_t code_point) {
+    if (code_point >= 0x110000) {
+        return 1;
+    }
+
+    size_t mid = unicode_width_top[code_point >> 12];
+    size_t leaf = unicode_width_mid[mid * 32 + ((code_point >> 7) & 31)];
+    uint8_t widths = unicode_width_leaves[leaf * 32 + ((code_point & 127) >> 2)];
 
-// End of https://www.cl.cam.ac.uk/~mgk25/ucs/wcwidth.c inherited code
-
-static int unicode_to_cp437(uint64_t code_point) {
-    switch (code_point) {
-        case 0x263a: return 1;
-        case 0x263b: return 2;
-        case 0x2665: return 3;
-        case 0x2666: return 4;
-        case 0x2663: return 5;
-        case 0x2660: return 6;
-        case 0x2022: return 7;
-        case 0x25d8: return 8;
-        case 0x25cb: return 9;
-        case 0x25d9: return 10;
-        case 0x2642: return 11;
-        case 0x2640: return 12;
-        case 0x266a: return 13;
-        case 0x266b: return 14;
-        case 0x263c: return 15;
-        case 0x25ba: return 16;
-        case 0x25c4: return 17;
-        case 0x2195: return 18;
-        case 0x203c: return 19;
-        case 0x00b6: return 20;
-        case 0x00a7: return 21;
-        case 0x25ac: return 22;
-        case 0x21a8: return 23;
-        case 0x2191: return 24;
-        case 0x2193: return 25;
-        case 0x2192: return 26;
-        case 0x2190: return 27;
-        case 0x221f: return 28;
-        case 0x2194: return 29;
-        case 0x25b2: return 30;
-        case 0x25bc: return 31;
-
-        case 0x2302: return 127;
-        case 0x00c7: return 128;
-        case 0x00fc: return 129;
-        case 0x00e9: return 130;
-        case 0x00e2: return 131;
-        case 0x00e4: return 132;
-        case 0x00e0: return 133;
-        case 0x00e5: return 134;
-        case 0x00e7: return 135;
-        case 0x00ea: return 136;
-        case 0x00eb: return 137;
-        case 0x00e8: return 138;
-        case 0x00ef: return 139;
-        case 0x00ee: return 140;
-        case 0x00ec: return 141;
-        case 0x00c4: return 142;
-        case 0x00c5: return 143;
-        case 0x00c9: return 144;
-        case 0x00e6: return 145;
-        case 0x00c6: return 146;
-        case 0x00f4: return 147;
-        case 0x00f6: return 148;
-        case 0x00f2: return 149;
-        case 0x00fb: return 150;
-        case 0x00f9: return 151;
-        case 0x00ff: return 152;
-        case 0x00d6: return 153;
-        case 0x00dc: return 154;
-        case 0x00a2: return 155;
-        case 0x00a3: return 156;
-        case 0x00a5: return 157;
-        case 0x20a7: return 158;
-        case 0x0192: return 159;
-        case 0x00e1: return 160;
-        case 0x00ed: return 161;
-        case 0x00f3: return 162;
-        case 0x00fa: return 163;
-        case 0x00f1: return 164;
-        case 0x00d1: return 165;
-        case 0x00aa: return 166;
-        case 0x00ba: return 167;
-        case 0x00bf: return 168;
-        case 0x2310: return 169;
-        case 0x00ac: return 170;
-        case 0x00bd: return 171;
-        case 0x00bc: return 172;
-        case 0x00a1: return 173;
-        case 0x00ab: return 174;
-        case 0x00bb: return 175;
-        case 0x2591: return 176;
-        case 0x2592: return 177;
-        case 0x2593: return 178;
-        case 0x2502: return 179;
-        case 0x2524: return 180;
-        case 0x2561: return 181;
-        case 0x2562: return 182;
-        case 0x2556: return 183;
-        case 0x2555: return 184;
-        case 0x2563: return 185;
-        case 0x2551: return 186;
-        case 0x2557: return 187;
-        case 0x255d: return 188;
-        case 0x255c: return 189;
-        case 0x255b: return 190;
-        case 0x2510: return 191;
-        case 0x2514: return 192;
-        case 0x2534: return 193;
-        case 0x252c: return 194;
-        case 0x251c: return 195;
-        case 0x2500: return 196;
-        case 0x253c: return 197;
-        case 0x255e: return 198;
-        case 0x255f: return 199;
-        case 0x255a: return 200;
-        case 0x2554: return 201;
-        case 0x2569: return 202;
-        case 0x2566: return 203;
-        case 0x2560: return 204;
-        case 0x2550: return 205;
-        case 0x256c: return 206;
-        case 0x2567: return 207;
-        case 0x2568: return 208;
-        case 0x2564: return 209;
-        case 0x2565: return 210;
-        case 0x2559: return 211;
-        case 0x2558: return 212;
-        case 0x2552: return 213;
-        case 0x2553: return 214;
-        case 0x256b: return 215;
-        case 0x256a: return 216;
-        case 0x2518: return 217;
-        case 0x250c: return 218;
-        case 0x2588: return 219;
-        case 0x2584: return 220;
-        case 0x258c: return 221;
-        case 0x2590: return 222;
-        case 0x2580: return 223;
-        case 0x03b1: return 224;
-        case 0x00df: return 225;
-        case 0x0393: return 226;
-        case 0x03c0: return 227;
-        case 0x03a3: return 228;
-        case 0x03c3: return 229;
-        case 0x00b5: return 230;
-        case 0x03c4: return 231;
-        case 0x03a6: return 232;
-        case 0x0398: return 233;
-        case 0x03a9: return 234;
-        case 0x03b4: return 235;
-        case 0x221e: return 236;
-        case 0x03c6: return 237;
-        case 0x03b5: return 238;
-        case 0x2229: return 239;
-        case 0x2261: return 240;
-        case 0x00b1: return 241;
-        case 0x2265: return 242;
-        case 0x2264: return 243;
-        case 0x2320: return 244;
-        case 0x2321: return 245;
-        case 0x00f7: return 246;
-        case 0x2248: return 247;
-        case 0x00b0: return 248;
-        case 0x2219: return 249;
-        case 0x00b7: return 250;
-        case 0x221a: return 251;
-        case 0x207f: return 252;
-        case 0x00b2: return 253;
-        case 0x25a0: return 254;
-    }
-
-    return -1;
+    return (widths >> ((code_point & 3) * 2)) & 3;
 }
 
-static void flanterm_putchar(struct flanterm_context *ctx, uint8_t c) {
-    if (ctx->discard_next || (c == 0x18 || c == 0x1a)) {
-        ctx->discard_next = false;
-        ctx->escape = false;
-        ctx->csi = false;
-        ctx->control_sequence = false;
-        ctx->unicode_remaining = 0;
-        ctx->osc = false;
-        ctx->osc_escape = false;
-        ctx->g_select = 0;
-        return;
-    }
+// Code point to CP437 mapping. cp437_index is indexed by code_point >> 6 and
+// selects a leaf of 64 glyphs in cp437_leaves, where 0 means there is no
+// CP437 equivalent. Leaf 0 is all empty.
+
+#define CP437_LIMIT 0x2700
+
+static const uint8_t cp437_index[] = {
+    0x00, 0x00, 0x01, 0x02, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x04, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0x07, 0x08, 0x00,
+    0x00, 0x00, 0x09, 0x00, 0x0a, 0x0b, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x00, 0x00
+};
 
-    if (ctx->unicode_remaining != 0) {
-        if ((c & 0xc0) != 0x80) {
-            ctx->unicode_remaining = 0;
-            goto unicode_error;
-        }
+static const uint8_t cp437_leaves[] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0xad, 0x9b, 0x9c, 0x00, 0x9d, 0x00, 0x15, 0x00, 0x00, 0xa6, 0xae,
+    0xaa, 0x00, 0x00, 0x00, 0xf8, 0xf1, 0xfd, 0x00, 0x00, 0xe6, 0x14, 0xfa,
+    0x00, 0x00, 0xa7, 0xaf, 0xac, 0xab, 0x00, 0xa8, 0x00, 0x00, 0x00, 0x00,
+    0x8e, 0x8f, 0x92, 0x80, 0x00, 0x90, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0xa5, 0x00, 0x00, 0x00, 0x00, 0x99, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x9a, 0x00, 0x00, 0xe1, 0x85, 0xa0, 0x83, 0x00, 0x84, 0x86, 0x91, 0x87,
+    0x8a, 0x82, 0x88, 0x89, 0x8d, 0xa1, 0x8c, 0x8b, 0x00, 0xa4, 0x95, 0xa2,
+    0x93, 0x00, 0x94, 0xf6, 0x00, 0x97, 0xa3, 0x96, 0x81, 0x00, 0x00, 0x98,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x9f, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xe2,
+    0x00, 0x00, 0x00, 0x00, 0xe9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0xe4, 0x00, 0x00, 0xe8, 0x00, 0x00, 0xea, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0xe0, 0x00, 0x00, 0xeb, 0xee, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xe3, 0x00, 0x00, 0xe5,
+    0xe7, 0x00, 0xed, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x13, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x9e,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x1b, 0x18, 0x1a, 0x19, 0x1d, 0x12, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x17, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0xf9, 0xfb, 0x00, 0x00, 0x00, 0xec, 0x1c,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xef, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xf7, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0xf0, 0x00, 0x00, 0xf3, 0xf2, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x7f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xa9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf4, 0xf5, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xc4, 0x00, 0xb3, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xda, 0x00, 0x00, 0x00, 0xbf, 0x00, 0x00, 0x00,
+    0xc0, 0x00, 0x00, 0x00, 0xd9, 0x00, 0x00, 0x00, 0xc3, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xb4, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xc2, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc1, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xc5, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xcd, 0xba, 0xd5, 0xd6, 0xc9, 0xb8, 0xb7, 0xbb, 0xd4, 0xd3, 0xc8, 0xbe,
+    0xbd, 0xbc, 0xc6, 0xc7, 0xcc, 0xb5, 0xb6, 0xb9, 0xd1, 0xd2, 0xcb, 0xcf,
+    0xd0, 0xca, 0xd8, 0xd7, 0xce, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xdf, 0x00, 0x00, 0x00, 0xdc, 0x00, 0x00, 0x00, 0xdb, 0x00, 0x00, 0x00,
+    0xdd, 0x00, 0x00, 0x00, 0xde, 0xb0, 0xb1, 0xb2, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfe, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x16, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x1e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+    0x1f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x11, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x08, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x0f, 0x00, 0x00, 0x00,
+    0x0c, 0x00, 0x0b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x05,
+    0x00, 0x03, 0x04, 0x00, 0x00, 0x00, 0x0d, 0x0e, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00
+};
 
-        ctx->unicode_remaining--;
-        ctx->code_point |= (uint64_t)(c & 0x3f) << (6 * ctx->unicode_remaining);
-        if (ctx->unicode_remaining != 0) {
-            return;
-        }
+int flanterm_unicode_to_cp437(uint32_t code_point) {
+    if (code_point >= CP437_LIMIT) {
+        return -1;
+    }
 
-        int cc = unicode_to_cp437(ctx->code_point);
+    uint8_t cc = cp437_leaves[cp437_index[code_point >> 6] * 64 + (code_point & 63)];
 
-        if (cc == -1) {
-            size_t replacement_width = (size_t)mk_wcwidth(ctx->code_point);
-            if (replacement_width > 0) {
-                ctx->raw_putchar(ctx, 0xfe);
-            }
-            for (size_t i = 1; i < replacement_width; i++) {
-                ctx->raw_putchar(ctx, ' ');
-            }
-        } else {
-            ctx->raw_putchar(ctx, cc);
-        }
-        return;
-    }
+    return cc != 0 ? cc : -1;
+}
 
-unicode_error:
-    if (c >= 0xc0 && c <= 0xf7) {
-        if (c >= 0xc0 && c <= 0xdf) {
-            ctx->unicode_remaining = 1;
-            ctx->code_point = (uint64_t)(c & 0x1f) << 6;
-        } else if (c >= 0xe0 && c <= 0xef) {
-            ctx->unicode_remaining = 2;
-            ctx->code_point = (uint64_t)(c & 0x0f) << (6 * 2);
-        } else if (c >= 0xf0 && c <= 0xf7) {
-            ctx->unicode_remaining = 3;
-            ctx->code_point = (uint64_t)(c & 0x07) << (6 * 3);
-        }
-        return;
+static void insert_blank(struct flanterm_context *ctx, size_t x, size_t y) {
+    if (x + 1 < ctx->cols) {
+        move_cells(ctx, y, x + 1, x, ctx->cols - x - 1);
     }
+}
 
-    if (ctx->escape == true) {
-        escape_parse(ctx, c);
-        return;
+// Performs count line feeds at once: the cursor walks down to the bottom
+// margin and whatever is left over is handed to the backend as one scroll.
+static void line_feed(struct flanterm_context *ctx, size_t count) {
+    ctx->unflushed_newline = true;
+
+    size_t x, y;
+    ctx->get_cursor_pos(ctx, &x, &y);
+
+    if (ctx->oob_output & FLANTERM_OOB_OUTPUT_ONLCR) {
+        x = 0;
     }
 
-    if (ctx->g_select) {
-        ctx->g_select--;
-        switch (c) {
-            case 'B':
-                ctx->charsets[ctx->g_select] = CHARSET_DEFAULT; break;
-            case '0':
-                ctx->charsets[ctx->g_select] = CHARSET_DEC_SPECIAL; break;
+    size_t bottom = ctx->scroll_bottom_margin - 1;
+
+    if (y > bottom) {
+        // Below the scrolling region the cursor just stops at the last row.
+        y = count < ctx->rows - y ? y + count : ctx->rows - 1;
+    } else {
+        size_t down = count < bottom - y ? count : bottom - y;
+        y += down;
+        if (count > down) {
+            ctx->scroll(ctx, ctx->scroll_top_margin, ctx->scroll_bottom_margin, count - down);
         }
-        ctx->g_select = 0;
-        return;
     }
 
+    ctx->set_cursor_pos(ctx, x, y);
+}
+
+static void control_char(struct flanterm_context *ctx, uint8_t c) {
     size_t x, y;
     ctx->get_cursor_pos(ctx, &x, &y);
 
@@ -1278,13 +1916,6 @@ unicode_error:
         case 0x00:
         case 0x7f:
             return;
-        case 0x9b:
-            ctx->csi = true;
-            // FALLTHRU
-        case 0x1b:
-            ctx->escape_offset = 0;
-            ctx->escape = true;
-            return;
         case '\t':
             if ((x / ctx->tab_size + 1) >= ctx->cols) {
                 ctx->set_cursor_pos(ctx, ctx->cols - 1, y);
@@ -1295,12 +1926,7 @@ unicode_error:
         case 0x0b:
         case 0x0c:
         case '\n':
-            if (y == ctx->scroll_bottom_margin - 1) {
-                ctx->scroll(ctx);
-                ctx->set_cursor_pos(ctx, (ctx->oob_output & FLANTERM_OOB_OUTPUT_ONLCR) ? 0 : x, y);
-            } else {
-                ctx->set_cursor_pos(ctx, (ctx->oob_output & FLANTERM_OOB_OUTPUT_ONLCR) ? 0 : x, y + 1);
-            }
+            line_feed(ctx, 1);
             return;
         case '\b':
             ctx->set_cursor_pos(ctx, x - 1, y);
@@ -1324,13 +1950,25 @@ unicode_error:
             return;
     }
 
+    // Anything else is not printed, but still makes room in insert mode.
     if (ctx->insert_mode == true) {
-        for (size_t i = ctx->cols - 1; ; i--) {
-            ctx->move_character(ctx, i + 1, y, i, y);
-            if (i == x) {
-                break;
-            }
-        }
+        insert_blank(ctx, x, y);
+    }
+}
+
+static inline void count_cells(struct flanterm_context *ctx, size_t count) {
+    ctx->unflushed_cells += count;
+    ctx->flush_stats.cells += count;
+}
+
+static void print_char(struct flanterm_context *ctx, uint8_t c) {
+    ctx->last_printed = c;
+    count_cells(ctx, 1);
+
+    if (ctx->insert_mode == true) {
+        size_t x, y;
+        ctx->get_cursor_pos(ctx, &x, &y);
+        insert_blank(ctx, x, y);
     }
 
     // Translate character set
@@ -1344,7 +1982,489 @@ unicode_error:
             break;
     }
 
-    if (c >= 0x20 && c <= 0x7e) {
-        ctx->raw_putchar(ctx, c);
+    ctx->raw_putchar(ctx, c);
+}
+
+// Stores the glyphs a code point is printed as in out, returns how many
+// there are (at most 2).
+static size_t code_point_glyphs(uint32_t code_point, uint8_t *out) {
+    int cc = flanterm_unicode_to_cp437(code_point);
+
+    if (cc != -1) {
+        out[0] = cc;
+        return 1;
+    }
+
+    size_t replacement_width = (size_t)flanterm_unicode_width(code_point);
+    if (replacement_width > 0) {
+        out[0] = 0xfe;
+    }
+    for (size_t i = 1; i < replacement_width; i++) {
+        out[i] = ' ';
+    }
+    return replacement_width;
+}
+
+static void print_code_point(struct flanterm_context *ctx, uint32_t code_point) {
+    ctx->last_printed = code_point;
+
+    uint8_t glyphs[2];
+    size_t count = code_point_glyphs(code_point, glyphs);
+    count_cells(ctx, count);
+
+    for (size_t i = 0; i < count; i++) {
+        ctx->raw_putchar(ctx, glyphs[i]);
+    }
+}
+
+static void print_glyphs(struct flanterm_context *ctx, const uint8_t *glyphs, size_t count) {
+    count_cells(ctx, count);
+
+    if (ctx->raw_putchars != NULL) {
+        ctx->raw_putchars(ctx, glyphs, count);
+        return;
     }
+
+    for (size_t i = 0; i < count; i++) {
+        ctx->raw_putchar(ctx, glyphs[i]);
+    }
+}
+
+#define REPEAT_BATCH 64
+
+// CSI b (REP): prints the last printed character count more times. Unless
+// it has to go through print_char(), the glyphs are handed to the backend a
+// batch at a time. Past a screenful, the repeats only scroll more copies of
+// the same line by, so whole lines of them are skipped.
+static void repeat_last_printed(struct flanterm_context *ctx, size_t count) {
+    uint32_t c = ctx->last_printed;
+    if (c == 0) {
+        return;
+    }
+
+    if (count == 0) {
+        count = 1;
+    }
+    if (count > ctx->rows * ctx->cols) {
+        count = ctx->rows * ctx->cols + (count - ctx->rows * ctx->cols) % ctx->cols;
+    }
+
+    if (c < 0x80 && (ctx->insert_mode || ctx->charsets[ctx->current_charset] != CHARSET_DEFAULT)) {
+        for (size_t i = 0; i < count; i++) {
+            print_char(ctx, c);
+        }
+        return;
+    }
+
+    uint8_t glyphs[2];
+    size_t n;
+    if (c < 0x80) {
+        glyphs[0] = c;
+        n = 1;
+    } else {
+        n = code_point_glyphs(c, glyphs);
+        if (n == 0) {
+            return;
+        }
+    }
+
+    uint8_t batch[REPEAT_BATCH];
+    size_t per_batch = REPEAT_BATCH / n;
+    for (size_t i = 0; i < per_batch * n; i++) {
+        batch[i] = glyphs[i % n];
+    }
+
+    while (count != 0) {
+        size_t k = count < per_batch ? count : per_batch;
+        print_glyphs(ctx, batch, k * n);
+        count -= k;
+    }
+}
+
+#undef REPEAT_BATCH
+
+// UTF-8 front end. Text is checked 64 bytes at a time: each block is turned
+// into bitmasks (one bit per byte) and the positions where continuation bytes
+// have to be are worked out from the lead bytes, so a whole block of well
+// formed text is validated with a handful of integer operations. The masks
+// are built with SSE2, AVX2 or NEON where they are available, and 8 bytes at
+// a time in general purpose registers otherwise.
+//
+// Anything that is not well formed, as well as control characters and
+// sequences cut off by the end of the buffer, is left to the byte at a time
+// parser, so how broken input and sequences split across writes are handled
+// does not change.
+
+#define UTF8_BLOCK 64
+#define UTF8_GLYPH_BATCH 128
+
+struct utf8_masks {
+    uint64_t stop;  // C0 controls, DEL and 0xf8-0xff
+    uint64_t high;  // >= 0x80
+    uint64_t ge_c0;
+    uint64_t ge_e0;
+    uint64_t ge_f0;
+};
+
+static void utf8_classify_tail(const uint8_t *p, size_t count, struct utf8_masks *m) {
+    m->stop = m->high = m->ge_c0 = m->ge_e0 = m->ge_f0 = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t c = p[i];
+        uint64_t bit = (uint64_t)1 << i;
+
+        if (c < 0x20 || c == 0x7f || c >= 0xf8) {
+            m->stop |= bit;
+        }
+        if (c >= 0x80) {
+            m->high |= bit;
+        }
+        if (c >= 0xc0) {
+            m->ge_c0 |= bit;
+        }
+        if (c >= 0xe0) {
+            m->ge_e0 |= bit;
+        }
+        if (c >= 0xf0) {
+            m->ge_f0 |= bit;
+        }
+    }
+
+    // Past the end of the buffer counts as a stop.
+    if (count < UTF8_BLOCK) {
+        m->stop |= ~(uint64_t)0 << count;
+    }
+}
+
+#if defined(__AVX2__) || defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+
+#if defined(__AVX2__)
+#define UTF8_VECTOR_SIZE 32
+#elif defined(__SSE2__) || defined(__ARM_NEON)
+#define UTF8_VECTOR_SIZE 16
+#endif
+
+typedef uint8_t utf8_vector __attribute__((vector_size(UTF8_VECTOR_SIZE)));
+typedef char utf8_vector_mask __attribute__((vector_size(UTF8_VECTOR_SIZE)));
+
+#if defined(__ARM_NEON) && !defined(__SSE2__)
+#include <arm_neon.h>
+#endif
+
+// One bit per byte of a comparison result, like pmovmskb.
+static inline uint64_t utf8_movemask(utf8_vector_mask v) {
+#if defined(__AVX2__)
+    return (uint32_t)__builtin_ia32_pmovmskb256(v);
+#elif defined(__SSE2__)
+    return (uint32_t)__builtin_ia32_pmovmskb128(v);
+#else
+    static const uint8_t weights[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    uint8x16_t t = vandq_u8((uint8x16_t)v, vld1q_u8(weights));
+    t = vpaddq_u8(t, t);
+    t = vpaddq_u8(t, t);
+    t = vpaddq_u8(t, t);
+    return vgetq_lane_u16(vreinterpretq_u16_u8(t), 0);
+#endif
+}
+
+static void utf8_classify(const uint8_t *p, struct utf8_masks *m) {
+    m->stop = m->high = m->ge_c0 = m->ge_e0 = m->ge_f0 = 0;
+
+    for (size_t i = 0; i < UTF8_BLOCK; i += UTF8_VECTOR_SIZE) {
+        utf8_vector v;
+        __builtin_memcpy(&v, &p[i], sizeof(v));
+
+        m->stop |= utf8_movemask((utf8_vector_mask)((v < 0x20) | (v == 0x7f) | (v >= 0xf8))) << i;
+        m->high |= utf8_movemask((utf8_vector_mask)(v >= 0x80)) << i;
+        m->ge_c0 |= utf8_movemask((utf8_vector_mask)(v >= 0xc0)) << i;
+        m->ge_e0 |= utf8_movemask((utf8_vector_mask)(v >= 0xe0)) << i;
+        m->ge_f0 |= utf8_movemask((utf8_vector_mask)(v >= 0xf0)) << i;
+    }
+}
+
+#undef UTF8_VECTOR_SIZE
+
+#else
+
+#define UTF8_ONES 0x0101010101010101ULL
+#define UTF8_HIGHS 0x8080808080808080ULL
+
+// Packs the top bit of each byte of x into the low 8 bits.
+static inline uint64_t utf8_pack(uint64_t x) {
+    return ((x >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+static void utf8_classify(const uint8_t *p, struct utf8_masks *m) {
+    m->stop = m->high = m->ge_c0 = m->ge_e0 = m->ge_f0 = 0;
+
+    for (size_t i = 0; i < UTF8_BLOCK; i += 8) {
+        uint64_t w;
+        __builtin_memcpy(&w, &p[i], 8);
+
+        // The same carry free comparisons as flanterm_printable_run(), a
+        // byte is >= 0x80 + n when its top bit is set and low + (0x80 - n)
+        // has the top bit set.
+        uint64_t low = w & ~UTF8_HIGHS;
+        uint64_t lt_20 = ~w & ~(low + 0x60 * UTF8_ONES);
+        uint64_t eq_7f = ~w & (low + UTF8_ONES);
+        uint64_t ge_f8 = w & (low + 0x08 * UTF8_ONES);
+
+        m->stop |= utf8_pack((lt_20 | eq_7f | ge_f8) & UTF8_HIGHS) << i;
+        m->high |= utf8_pack(w & UTF8_HIGHS) << i;
+        m->ge_c0 |= utf8_pack(w & (low + 0x40 * UTF8_ONES) & UTF8_HIGHS) << i;
+        m->ge_e0 |= utf8_pack(w & (low + 0x20 * UTF8_ONES) & UTF8_HIGHS) << i;
+        m->ge_f0 |= utf8_pack(w & (low + 0x10 * UTF8_ONES) & UTF8_HIGHS) << i;
+    }
+}
+
+#undef UTF8_HIGHS
+#undef UTF8_ONES
+
+#endif
+
+// Prints the longest run of well formed UTF-8 (and printable ASCII if
+// ascii is true) at the start of buf, returns the number of bytes consumed.
+// Only meant for the ground state, and only with no sequence in progress.
+static size_t print_utf8_run(struct flanterm_context *ctx, const uint8_t *buf, size_t count, bool ascii) {
+    uint8_t glyphs[UTF8_GLYPH_BATCH];
+    size_t glyphs_i = 0;
+    size_t i = 0;
+    uint64_t carry = 0;
+    uint32_t last = 0;
+
+    for (size_t block = 0; block < count; block += UTF8_BLOCK) {
+        struct utf8_masks m;
+        if (count - block >= UTF8_BLOCK) {
+            utf8_classify(&buf[block], &m);
+        } else {
+            utf8_classify_tail(&buf[block], count - block, &m);
+        }
+
+        uint64_t lead2 = m.ge_c0 & ~m.ge_e0;
+        uint64_t lead3 = m.ge_e0 & ~m.ge_f0;
+        uint64_t lead4 = m.ge_f0;
+        uint64_t continuation = m.high & ~m.ge_c0;
+
+        // Where continuation bytes are due, including those of sequences
+        // started in the previous block.
+        uint64_t expected = carry | lead2 << 1 | lead3 << 1 | lead3 << 2
+                          | lead4 << 1 | lead4 << 2 | lead4 << 3;
+        carry = lead2 >> 63 | lead3 >> 63 | lead3 >> 62
+              | lead4 >> 63 | lead4 >> 62 | lead4 >> 61;
+
+        uint64_t error = (continuation ^ expected) | m.stop;
+        if (!ascii) {
+            error |= ~m.high;
+        }
+
+        size_t end = block + (error != 0 ? (size_t)__builtin_ctzll(error) : UTF8_BLOCK);
+        if (end > count) {
+            end = count;
+        }
+
+        // Everything up to end is known to be well formed, decode every
+        // sequence that is complete before it.
+        while (i < end) {
+            uint8_t c = buf[i];
+            uint32_t code_point;
+
+            if (c < 0x80) {
+                code_point = c;
+                glyphs[glyphs_i++] = c;
+                i++;
+            } else if (c < 0xe0) {
+                if (i + 2 > end) {
+                    break;
+                }
+                code_point = (uint32_t)(c & 0x1f) << 6 | (buf[i + 1] & 0x3f);
+                glyphs_i += code_point_glyphs(code_point, &glyphs[glyphs_i]);
+                i += 2;
+            } else if (c < 0xf0) {
+                if (i + 3 > end) {
+                    break;
+                }
+                code_point = (uint32_t)(c & 0x0f) << 12 | (uint32_t)(buf[i + 1] & 0x3f) << 6
+                           | (buf[i + 2] & 0x3f);
+                glyphs_i += code_point_glyphs(code_point, &glyphs[glyphs_i]);
+                i += 3;
+            } else {
+                if (i + 4 > end) {
+                    break;
+                }
+                code_point = (uint32_t)(c & 0x07) << 18 | (uint32_t)(buf[i + 1] & 0x3f) << 12
+                           | (uint32_t)(buf[i + 2] & 0x3f) << 6 | (buf[i + 3] & 0x3f);
+                glyphs_i += code_point_glyphs(code_point, &glyphs[glyphs_i]);
+                i += 4;
+            }
+
+            last = code_point;
+
+            if (glyphs_i > UTF8_GLYPH_BATCH - 2) {
+                print_glyphs(ctx, glyphs, glyphs_i);
+                glyphs_i = 0;
+            }
+        }
+
+        if (error != 0) {
+            break;
+        }
+    }
+
+    print_glyphs(ctx, glyphs, glyphs_i);
+    if (last != 0) {
+        ctx->last_printed = last;
+    }
+    return i;
+}
+
+#undef UTF8_GLYPH_BATCH
+#undef UTF8_BLOCK
+
+static void flanterm_parse(struct flanterm_context *ctx, const uint8_t *buf, size_t count) {
+    ctx->unflushed_bytes += count;
+    ctx->flush_stats.bytes += count;
+
+    // Kept in a local so that the common transitions do not have to go
+    // through memory, synchronised with the context around anything that
+    // calls out of the parser.
+    uint8_t state = ctx->parser_state;
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t c = buf[i];
+
+        if (ctx->unicode_remaining != 0) {
+            if ((c & 0xc0) == 0x80) {
+                ctx->unicode_remaining--;
+                ctx->code_point |= (uint64_t)(c & 0x3f) << (6 * ctx->unicode_remaining);
+                if (ctx->unicode_remaining == 0) {
+                    print_code_point(ctx, ctx->code_point);
+                }
+                continue;
+            }
+
+            // Broken sequence, start over with this byte.
+            ctx->unicode_remaining = 0;
+        }
+
+        uint8_t transition = parser_table[state][byte_class[c]];
+        state = transition & 0x0f;
+
+        switch (transition >> 4) {
+            case ACTION_NONE:
+                continue;
+            case ACTION_UTF8:
+                if (state == STATE_GROUND) {
+                    size_t run = print_utf8_run(ctx, &buf[i], count - i,
+                        !ctx->insert_mode && ctx->charsets[ctx->current_charset] == CHARSET_DEFAULT);
+                    if (run != 0) {
+                        i += run - 1;
+                        continue;
+                    }
+                }
+                if (c <= 0xdf) {
+                    ctx->unicode_remaining = 1;
+                    ctx->code_point = (uint64_t)(c & 0x1f) << 6;
+                } else if (c <= 0xef) {
+                    ctx->unicode_remaining = 2;
+                    ctx->code_point = (uint64_t)(c & 0x0f) << (6 * 2);
+                } else {
+                    ctx->unicode_remaining = 3;
+                    ctx->code_point = (uint64_t)(c & 0x07) << (6 * 3);
+                }
+                continue;
+            case ACTION_CHARSET_SELECT:
+                ctx->g_select = c - '\'';
+                continue;
+            case ACTION_CHARSET:
+                ctx->g_select--;
+                switch (c) {
+                    case 'B':
+                        ctx->charsets[ctx->g_select] = CHARSET_DEFAULT; break;
+                    case '0':
+                        ctx->charsets[ctx->g_select] = CHARSET_DEC_SPECIAL; break;
+                }
+                ctx->g_select = 0;
+                continue;
+            case ACTION_CSI_CLEAR:
+                for (size_t j = 0; j < FLANTERM_MAX_ESC_VALUES; j++)
+                    ctx->esc_values[j] = 0;
+                ctx->esc_values_i = 0;
+                continue;
+            case ACTION_DEC_PRIVATE:
+                ctx->dec_private = true;
+                continue;
+            case ACTION_PARAM:
+                if (ctx->esc_values_i == FLANTERM_MAX_ESC_VALUES) {
+                    state = STATE_CSI_PARAM;
+                    continue;
+                }
+                ctx->esc_values[ctx->esc_values_i] *= 10;
+                ctx->esc_values[ctx->esc_values_i] += c - '0';
+                continue;
+            case ACTION_PARAM_EMPTY:
+                if (ctx->esc_values_i == FLANTERM_MAX_ESC_VALUES) {
+                    continue;
+                }
+                ctx->esc_values[ctx->esc_values_i] = 0;
+                ctx->esc_values_i++;
+                continue;
+            case ACTION_PARAM_END:
+                ctx->esc_values_i++;
+                continue;
+        }
+
+        ctx->parser_state = state;
+
+        switch (transition >> 4) {
+            case ACTION_PRINT: {
+                if (ctx->insert_mode || ctx->charsets[ctx->current_charset] != CHARSET_DEFAULT) {
+                    print_char(ctx, c);
+                    break;
+                }
+
+                // Hand the whole run of plain ASCII to the backend at once.
+                size_t run = flanterm_printable_run(&buf[i], count - i);
+                ctx->last_printed = buf[i + run - 1];
+                count_cells(ctx, run);
+                if (ctx->raw_putchars != NULL) {
+                    ctx->raw_putchars(ctx, &buf[i], run);
+                } else {
+                    for (size_t j = 0; j < run; j++) {
+                        ctx->raw_putchar(ctx, buf[i + j]);
+                    }
+                }
+                i += run - 1;
+                break;
+            }
+            case ACTION_EXECUTE:
+                // A run of line feeds that leaves the parser where it was
+                // scrolls the backend once instead of once per line.
+                if (c >= 0x0a && c <= 0x0c && parser_table[state][CLASS_CONTROL] == transition) {
+                    size_t run = 1;
+                    while (i + run < count && buf[i + run] >= 0x0a && buf[i + run] <= 0x0c) {
+                        run++;
+                    }
+                    line_feed(ctx, run);
+                    i += run - 1;
+                    break;
+                }
+                control_char(ctx, c);
+                break;
+            case ACTION_ESC_DISPATCH:
+                escape_parse(ctx, c);
+                break;
+            case ACTION_PARAM_END_CSI_DISPATCH:
+                ctx->esc_values_i++;
+                // FALLTHRU
+            case ACTION_CSI_DISPATCH:
+                control_sequence_parse(ctx, c);
+                break;
+        }
+
+        state = ctx->parser_state;
+    }
+
+    ctx->parser_state = state;
 }
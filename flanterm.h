@@ -54,6 +54,39 @@ extern "C" {
 #define FLANTERM_OOB_OUTPUT_ONOCR (1 << 6)
 #define FLANTERM_OOB_OUTPUT_OPOST (1 << 7)
 
+#define FLANTERM_FLUSH_NEWLINE (1 << 0)
+#define FLANTERM_FLUSH_BYTES (1 << 1)
+#define FLANTERM_FLUSH_CELLS (1 << 2)
+#define FLANTERM_FLUSH_TIME (1 << 3)
+
+struct flanterm_context;
+struct flanterm_producer;
+
+// When to flush while autoflush is off, see flanterm_set_flush_policy().
+struct flanterm_flush_policy {
+    // FLANTERM_FLUSH_* conditions, any of them met is enough. With none set
+    // only flanterm_flush() flushes.
+    uint32_t flags;
+    // Line feeds, or at least this many bytes parsed or cells printed, since
+    // the last flush.
+    size_t bytes;
+    size_t cells;
+    // At least interval since the last flush, in the units of clock(), which
+    // returns a monotonic time.
+    uint64_t interval;
+    uint64_t (*clock)(struct flanterm_context *);
+};
+
+// Counted since the context was set up. writes are batches of bytes given
+// to the parser, from flanterm_write() or taken from a ring, so writes and
+// bytes per flush show how much the flushes were coalesced.
+struct flanterm_flush_stats {
+    uint64_t writes;
+    uint64_t bytes;
+    uint64_t cells;
+    uint64_t flushes;
+};
+
 struct flanterm_context {
     /* internal use */
 
@@ -61,24 +94,18 @@ struct flanterm_context {
     bool autoflush;
     bool cursor_enabled;
     bool scroll_enabled;
-    bool control_sequence;
-    bool csi;
-    bool escape;
-    bool osc;
-    bool osc_escape;
-    bool rrr;
-    bool discard_next;
     bool bold;
     bool bg_bold;
     bool reverse_video;
     bool dec_private;
     bool insert_mode;
+    uint8_t parser_state;
     uint64_t code_point;
     size_t unicode_remaining;
+    uint32_t last_printed;
     uint8_t g_select;
     uint8_t charsets[2];
     size_t current_charset;
-    size_t escape_offset;
     size_t esc_values_i;
     size_t saved_cursor_x;
     size_t saved_cursor_y;
@@ -95,12 +122,40 @@ struct flanterm_context {
     size_t saved_state_current_primary;
     size_t saved_state_current_bg;
 
+    // Set up by flanterm_async_init(), async_ring is NULL while writes are
+    // synchronous. async_head and async_tail count the bytes ever written to
+    // and read from the ring.
+    uint8_t *async_ring;
+    size_t async_ring_size;
+    size_t async_head;
+    size_t async_tail;
+    size_t async_dropped;
+    bool async_sleeping;
+    bool async_stop;
+    void (*async_wait)(struct flanterm_context *);
+    void (*async_notify)(struct flanterm_context *);
+    // Registered by flanterm_producer_init(), newest first.
+    struct flanterm_producer *producers;
+    bool flush_policy_set;
+    struct flanterm_flush_policy flush_policy;
+    size_t unflushed_bytes;
+    size_t unflushed_cells;
+    bool unflushed_newline;
+    uint64_t last_flush_time;
+    struct flanterm_flush_stats flush_stats;
+
     /* to be set by backend */
 
     size_t rows, cols;
 
     void (*raw_putchar)(struct flanterm_context *, uint8_t c);
+    // Optional, may be NULL. Prints a run of characters as if raw_putchar()
+    // was called for each of them.
+    void (*raw_putchars)(struct flanterm_context *, const uint8_t *s, size_t count);
     void (*clear)(struct flanterm_context *, bool move);
+    // Optional, may be NULL. Fills columns x0 to x1 - 1 of rows y0 to y1 - 1
+    // with c in the current colours, without moving the cursor.
+    void (*fill_region)(struct flanterm_context *, size_t x0, size_t y0, size_t x1, size_t y1, uint8_t c);
     void (*set_cursor_pos)(struct flanterm_context *, size_t x, size_t y);
     void (*get_cursor_pos)(struct flanterm_context *, size_t *x, size_t *y);
     void (*set_text_fg)(struct flanterm_context *, size_t fg);
@@ -114,23 +169,133 @@ struct flanterm_context {
     void (*set_text_fg_default_bright)(struct flanterm_context *);
     void (*set_text_bg_default_bright)(struct flanterm_context *);
     void (*move_character)(struct flanterm_context *, size_t new_x, size_t new_y, size_t old_x, size_t old_y);
-    void (*scroll)(struct flanterm_context *);
-    void (*revscroll)(struct flanterm_context *);
+    // Optional, may be NULL. Moves len cells of row y from column src_x to
+    // column dst_x as if move_character() was called for each of them, the
+    // spans may overlap.
+    void (*move_span)(struct flanterm_context *, size_t y, size_t dst_x, size_t src_x, size_t len);
+    // Move rows top to bottom - 1 up (scroll) or down (revscroll) by count
+    // lines, clearing the rows that enter the region. top < bottom and
+    // count > 0, count may exceed the height of the region.
+    void (*scroll)(struct flanterm_context *, size_t top, size_t bottom, size_t count);
+    void (*revscroll)(struct flanterm_context *, size_t top, size_t bottom, size_t count);
     void (*swap_palette)(struct flanterm_context *);
     void (*save_state)(struct flanterm_context *);
     void (*restore_state)(struct flanterm_context *);
     void (*double_buffer_flush)(struct flanterm_context *);
+    // Optional, may be NULL. Does part of what double_buffer_flush() does,
+    // see flanterm_flush_step().
+    bool (*flush_step)(struct flanterm_context *, size_t max_cells);
     void (*full_refresh)(struct flanterm_context *);
     void (*deinit)(struct flanterm_context *, void (*)(void *, size_t));
 
     /* to be set by client */
 
     void (*callback)(struct flanterm_context *, uint64_t, uint64_t, uint64_t, uint64_t);
+    // Optional, may be NULL. Calls fn(ctx, i, arg) for every i from 0 to
+    // n - 1, on as many threads as it likes, and returns once they have all
+    // returned. Backends use it to draw parts of the screen in parallel.
+    void (*parallel_for)(struct flanterm_context *, size_t n,
+                         void (*fn)(struct flanterm_context *, size_t i, void *arg), void *arg);
+    // Rows flush_priority_top to flush_priority_bottom - 1, such as a status
+    // line, are drawn first by flanterm_flush_step().
+    size_t flush_priority_top, flush_priority_bottom;
 };
 
+// Called once by the backend when the context is set up, before it is used.
+// Also does what flanterm_context_reinit() does, which RIS repeats later.
+void flanterm_context_init(struct flanterm_context *ctx);
 void flanterm_context_reinit(struct flanterm_context *ctx);
 void flanterm_write(struct flanterm_context *ctx, const char *buf, size_t count);
 
+// Flushes, like double_buffer_flush(), and starts counting towards the
+// next flush the policy asks for over again.
+void flanterm_flush(struct flanterm_context *ctx);
+// Flushes in steps that each go through about max_cells cells, comparing,
+// updating or drawing them, plus the rows of the cursor and the one it left,
+// so that a flush can be spread over several calls with a bound on each.
+// The cursor and the priority rows are drawn first. Writes between steps
+// are fine, the next step picks them up. Backends without flush_step()
+// flush in one go.
+// Returns true while there is more to draw.
+bool flanterm_flush_step(struct flanterm_context *ctx, size_t max_cells);
+// Turns autoflush off and flushes at the end of each write that meets the
+// policy instead. Writes are checked when they end, so with
+// FLANTERM_FLUSH_TIME a terminal that stops being written to is only
+// flushed by flanterm_flush(). FLANTERM_FLUSH_TIME is ignored if clock is
+// NULL. The policy stays in place across a reset (RIS).
+void flanterm_set_flush_policy(struct flanterm_context *ctx, const struct flanterm_flush_policy *policy);
+
+// Asynchronous writes. Once set up, flanterm_write() only copies the bytes
+// into ring, a buffer of size bytes (a power of two), and returns. They are
+// parsed and drawn by a renderer thread running flanterm_async_run(), which
+// is where all backend and client callbacks are called from from then on.
+// flanterm_write() may only be called by one thread at a time, and nothing
+// but it and flanterm_async_stop() may use the context while the renderer
+// runs. Returns false if size is not a power of two or a hook is NULL.
+//
+// Writes never wait for the renderer: one that does not fit in the free
+// space of the ring is dropped whole and counted by flanterm_async_dropped().
+//
+// The renderer calls wait() when the ring is empty, writes and
+// flanterm_async_stop() call notify() to wake it up. notify() can come before
+// the wait() it is meant for, so wait() has to return at once if notify()
+// was called since it last returned, as with a semaphore.
+bool flanterm_async_init(struct flanterm_context *ctx, void *ring, size_t size,
+                         void (*wait)(struct flanterm_context *),
+                         void (*notify)(struct flanterm_context *));
+// Parses and draws what is written until flanterm_async_stop() is called,
+// then returns once everything written before that has been drawn. Checks
+// whether to flush once per batch of writes found in the rings.
+void flanterm_async_run(struct flanterm_context *ctx);
+void flanterm_async_stop(struct flanterm_context *ctx);
+// Returns the number of bytes dropped because the ring was full.
+size_t flanterm_async_dropped(struct flanterm_context *ctx);
+
+// Line-atomic writes from many threads without a lock. Each thread (or CPU)
+// gets a producer of its own, set up with flanterm_producer_init(), and
+// writes to it with flanterm_produce(), which does not touch the context.
+// Bytes are held in ring, a buffer of size bytes (a power of two), until
+// the line they belong to is complete. flanterm_merge() then passes the
+// complete lines of every producer to the terminal, whole and in order for
+// each producer, and flushes as write() would. In asynchronous mode the
+// renderer merges them and producers wake it up, otherwise flanterm_merge()
+// is called by whichever thread owns the context.
+//
+// A write that does not fit in the free space of the ring is dropped along
+// with the rest of the lines it is part of, so lines show up whole or not at
+// all. Lines longer than the ring are always dropped.
+struct flanterm_producer {
+    /* internal use */
+
+    struct flanterm_context *ctx;
+    struct flanterm_producer *next;
+    uint8_t *ring;
+    size_t ring_size;
+    // Counts of the bytes ever written, up to the end of the last complete
+    // line, and merged.
+    size_t head;
+    size_t published;
+    size_t tail;
+    size_t dropped;
+    bool discarding;
+};
+
+// Returns false if size is not a power of two. Producers stay registered
+// for as long as the context exists.
+bool flanterm_producer_init(struct flanterm_context *ctx, struct flanterm_producer *producer, void *ring, size_t size);
+void flanterm_produce(struct flanterm_producer *producer, const char *buf, size_t count);
+// Passes on the line written so far without waiting for its end.
+void flanterm_producer_flush(struct flanterm_producer *producer);
+// Returns the number of bytes dropped because the ring was full.
+size_t flanterm_producer_dropped(struct flanterm_producer *producer);
+// Returns false if no producer had anything.
+bool flanterm_merge(struct flanterm_context *ctx);
+
+// Returns the number of columns a code point occupies (0, 1 or 2).
+int flanterm_unicode_width(uint32_t code_point);
+// Returns the CP437 glyph for a code point, or -1 if there is none.
+int flanterm_unicode_to_cp437(uint32_t code_point);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,108 @@
+// Asynchronous writes: a writer thread floods a small ring while the
+// renderer draws from it. Whatever the ring took has to end up on screen
+// exactly as if it had been written synchronously, which is checked by
+// replaying the accepted writes into a second terminal and comparing the
+// framebuffers.
+//
+// Usage: async [ring size] [writes]
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flanterm.h"
+#include "backends/fb.h"
+
+#define WIDTH 800
+#define HEIGHT 600
+
+static sem_t sem;
+
+static void test_free(void *ptr, size_t size) {
+    (void)size;
+    free(ptr);
+}
+
+static void test_wait(struct flanterm_context *ctx) {
+    (void)ctx;
+    sem_wait(&sem);
+}
+
+static void test_notify(struct flanterm_context *ctx) {
+    (void)ctx;
+    sem_post(&sem);
+}
+
+static void *renderer(void *arg) {
+    flanterm_async_run(arg);
+    return NULL;
+}
+
+static struct flanterm_context *new_terminal(uint32_t *framebuffer) {
+    return flanterm_fb_init(malloc, test_free, framebuffer, WIDTH, HEIGHT, WIDTH * 4,
+#ifdef FLANTERM_FB_SUPPORT_BPP
+                            8, 16, 8, 8, 8, 0,
+#endif
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+                            NULL,
+#endif
+                            NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, 1, 1, 1, 0);
+}
+
+int main(int argc, char **argv) {
+    size_t ring_size = argc > 1 ? strtoul(argv[1], NULL, 0) : 4096;
+    size_t writes = argc > 2 ? strtoul(argv[2], NULL, 0) : 20000;
+
+    uint32_t *framebuffer = calloc(WIDTH * HEIGHT, sizeof(uint32_t));
+    uint32_t *reference_framebuffer = calloc(WIDTH * HEIGHT, sizeof(uint32_t));
+    struct flanterm_context *ctx = new_terminal(framebuffer);
+    struct flanterm_context *reference = new_terminal(reference_framebuffer);
+    void *ring = malloc(ring_size);
+    char **lines = calloc(writes, sizeof(char *));
+    bool *accepted = calloc(writes, sizeof(bool));
+    if (ctx == NULL || reference == NULL || ring == NULL || lines == NULL || accepted == NULL) {
+        fprintf(stderr, "async: out of memory\n");
+        return 1;
+    }
+
+    sem_init(&sem, 0, 0);
+    if (!flanterm_async_init(ctx, ring, ring_size, test_wait, test_notify)) {
+        fprintf(stderr, "async: bad ring size %zu\n", ring_size);
+        return 1;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, renderer, ctx);
+
+    for (size_t i = 0; i < writes; i++) {
+        char buf[160];
+        int len = snprintf(buf, sizeof(buf), "\x1b[3%zum[%6zu] line %.*s\n", i % 8, i,
+                           (int)(i % 60), "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefgh");
+        lines[i] = strdup(buf);
+
+        // Only this thread writes, so a change in the count is this write.
+        size_t dropped = flanterm_async_dropped(ctx);
+        flanterm_write(ctx, buf, len);
+        accepted[i] = flanterm_async_dropped(ctx) == dropped;
+    }
+
+    flanterm_async_stop(ctx);
+    pthread_join(thread, NULL);
+
+    size_t count = 0;
+    for (size_t i = 0; i < writes; i++) {
+        if (accepted[i]) {
+            flanterm_write(reference, lines[i], strlen(lines[i]));
+            count++;
+        }
+    }
+
+    bool match = memcmp(framebuffer, reference_framebuffer, WIDTH * HEIGHT * sizeof(uint32_t)) == 0;
+    printf("async: ring %zu, %zu of %zu writes accepted, %zu bytes dropped: %s\n",
+           ring_size, count, writes, flanterm_async_dropped(ctx), match ? "ok" : "MISMATCH");
+
+    return match ? 0 : 1;
+}
@@ -0,0 +1,236 @@
+// Line-atomic producers: threads write numbered lines, some of them in two
+// pieces, to producers of their own while the renderer merges them into a
+// backend that only records the characters it is given. Every line that
+// shows up has to be whole, and the lines of each producer have to be in
+// order. Also reports how fast the producers write.
+//
+// Usage: producers [producers] [lines per producer] [ring size]
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flanterm.h"
+
+#define MAX_PRODUCERS 64
+#define LINE_X "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+
+static struct flanterm_context ctx;
+static struct flanterm_producer producers[MAX_PRODUCERS];
+static size_t lines_per_producer;
+static size_t ring_size;
+
+static sem_t sem;
+
+static char *output;
+static size_t output_i;
+static size_t cursor_x, cursor_y;
+
+static void test_raw_putchar(struct flanterm_context *_ctx, uint8_t c) {
+    (void)_ctx;
+    output[output_i++] = c;
+}
+
+static void test_clear(struct flanterm_context *_ctx, bool move) {
+    (void)_ctx;
+    (void)move;
+}
+
+static void test_set_cursor_pos(struct flanterm_context *_ctx, size_t x, size_t y) {
+    (void)_ctx;
+    cursor_x = x;
+    cursor_y = y;
+}
+
+static void test_get_cursor_pos(struct flanterm_context *_ctx, size_t *x, size_t *y) {
+    (void)_ctx;
+    *x = cursor_x;
+    *y = cursor_y;
+}
+
+static void test_set_colour(struct flanterm_context *_ctx, size_t colour) {
+    (void)_ctx;
+    (void)colour;
+}
+
+static void test_set_colour_rgb(struct flanterm_context *_ctx, uint32_t colour) {
+    (void)_ctx;
+    (void)colour;
+}
+
+static void test_nop(struct flanterm_context *_ctx) {
+    (void)_ctx;
+}
+
+static void test_move_character(struct flanterm_context *_ctx, size_t new_x, size_t new_y, size_t old_x, size_t old_y) {
+    (void)_ctx;
+    (void)new_x;
+    (void)new_y;
+    (void)old_x;
+    (void)old_y;
+}
+
+static void test_scroll(struct flanterm_context *_ctx, size_t top, size_t bottom, size_t count) {
+    (void)_ctx;
+    (void)top;
+    (void)bottom;
+    (void)count;
+}
+
+static void test_deinit(struct flanterm_context *_ctx, void (*_free)(void *, size_t)) {
+    (void)_ctx;
+    (void)_free;
+}
+
+static void test_wait(struct flanterm_context *_ctx) {
+    (void)_ctx;
+    sem_wait(&sem);
+}
+
+static void test_notify(struct flanterm_context *_ctx) {
+    (void)_ctx;
+    sem_post(&sem);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *renderer(void *arg) {
+    (void)arg;
+    flanterm_async_run(&ctx);
+    return NULL;
+}
+
+static void *producer_thread(void *arg) {
+    size_t id = (uintptr_t)arg;
+    struct flanterm_producer *producer = &producers[id];
+
+    flanterm_producer_init(&ctx, producer, malloc(ring_size), ring_size);
+
+    for (size_t k = 0; k < lines_per_producer; k++) {
+        char buf[128];
+        size_t len = snprintf(buf, sizeof(buf), "{%zu,%zu,%.*s}\n", id, k, (int)(k % 40), LINE_X);
+
+        // Every third line is written in two pieces.
+        size_t cut = k % 3 == 0 ? len / 2 : len;
+        flanterm_produce(producer, buf, cut);
+        if (cut < len) {
+            flanterm_produce(producer, buf + cut, len - cut);
+        }
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 0) : 4;
+    lines_per_producer = argc > 2 ? strtoul(argv[2], NULL, 0) : 20000;
+    ring_size = argc > 3 ? strtoul(argv[3], NULL, 0) : 1024;
+    if (count == 0 || count > MAX_PRODUCERS || ring_size == 0 || (ring_size & (ring_size - 1)) != 0) {
+        fprintf(stderr, "producers: bad arguments\n");
+        return 1;
+    }
+
+    output = malloc(count * lines_per_producer * 64 + 1);
+    if (output == NULL) {
+        fprintf(stderr, "producers: out of memory\n");
+        return 1;
+    }
+
+    // Wide enough that no line wraps.
+    ctx.rows = 50;
+    ctx.cols = 1000;
+    ctx.raw_putchar = test_raw_putchar;
+    ctx.clear = test_clear;
+    ctx.set_cursor_pos = test_set_cursor_pos;
+    ctx.get_cursor_pos = test_get_cursor_pos;
+    ctx.set_text_fg = test_set_colour;
+    ctx.set_text_bg = test_set_colour;
+    ctx.set_text_fg_bright = test_set_colour;
+    ctx.set_text_bg_bright = test_set_colour;
+    ctx.set_text_fg_rgb = test_set_colour_rgb;
+    ctx.set_text_bg_rgb = test_set_colour_rgb;
+    ctx.set_text_fg_default = test_nop;
+    ctx.set_text_bg_default = test_nop;
+    ctx.set_text_fg_default_bright = test_nop;
+    ctx.set_text_bg_default_bright = test_nop;
+    ctx.move_character = test_move_character;
+    ctx.scroll = test_scroll;
+    ctx.revscroll = test_scroll;
+    ctx.swap_palette = test_nop;
+    ctx.save_state = test_nop;
+    ctx.restore_state = test_nop;
+    ctx.double_buffer_flush = test_nop;
+    ctx.full_refresh = test_nop;
+    ctx.deinit = test_deinit;
+    flanterm_context_init(&ctx);
+
+    static uint8_t ring[4096];
+    sem_init(&sem, 0, 0);
+    flanterm_async_init(&ctx, ring, sizeof(ring), test_wait, test_notify);
+
+    pthread_t render_thread, threads[MAX_PRODUCERS];
+    pthread_create(&render_thread, NULL, renderer, NULL);
+
+    double start = now();
+    for (size_t i = 0; i < count; i++) {
+        pthread_create(&threads[i], NULL, producer_thread, (void *)(uintptr_t)i);
+    }
+    for (size_t i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    flanterm_async_stop(&ctx);
+    pthread_join(render_thread, NULL);
+    output[output_i] = 0;
+
+    // Line feeds move the cursor rather than being printed, so the lines
+    // come out back to back.
+    long last[MAX_PRODUCERS];
+    for (size_t i = 0; i < MAX_PRODUCERS; i++) {
+        last[i] = -1;
+    }
+
+    size_t seen = 0;
+    char *p = output;
+    while (*p != 0) {
+        size_t id, k;
+        int len;
+        if (sscanf(p, "{%zu,%zu,%n", &id, &k, &len) != 2 || id >= count) {
+            printf("producers: broken line at %zu: %.40s\n", (size_t)(p - output), p);
+            return 1;
+        }
+        p += len;
+
+        size_t x = 0;
+        while (*p == 'x') {
+            p++;
+            x++;
+        }
+        if (*p != '}' || x != k % 40 || (long)k <= last[id]) {
+            printf("producers: broken or reordered line %zu of producer %zu\n", k, id);
+            return 1;
+        }
+        last[id] = k;
+        p++;
+        seen++;
+    }
+
+    size_t dropped = 0;
+    for (size_t i = 0; i < count; i++) {
+        dropped += flanterm_producer_dropped(&producers[i]);
+    }
+
+    printf("producers: %zu producers, %zu lines seen, %zu bytes dropped, %.1f Mlines/s: ok\n",
+           count, seen, dropped, count * (double)lines_per_producer / elapsed / 1e6);
+
+    return 0;
+}
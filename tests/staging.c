@@ -0,0 +1,124 @@
+// Drawing speed of the framebuffer backend on a framebuffer in memory, to
+// compare builds with and without FLANTERM_FB_ENABLE_STAGING. Each frame
+// replaces every cell of the screen, either with text or with blanks, and
+// flushes. Cells with the default background show the canvas, the others
+// are drawn in solid colours.
+//
+// Usage: staging [frames]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flanterm.h"
+#include "backends/fb.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+
+static void test_free(void *ptr, size_t size) {
+    (void)size;
+    free(ptr);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// A screen of text, shifted by frame so that every cell changes from one
+// frame to the next and no run of cells repeats.
+static size_t make_text(struct flanterm_context *ctx, char *buf, size_t frame, bool solid) {
+    size_t n = sprintf(buf, "\x1b[H%s", solid ? "\x1b[44m" : "\x1b[49m");
+
+    for (size_t y = 0; y < ctx->rows; y++) {
+        n += sprintf(buf + n, "\x1b[%zu;1H\x1b[3%zum", y + 1, 1 + (y + frame) % 7);
+        for (size_t x = 0; x < ctx->cols; x++) {
+            buf[n++] = 'A' + (x + y + frame) % 58;
+        }
+    }
+
+    return n;
+}
+
+static void run(uint32_t *framebuffer, uint32_t *canvas, size_t scale, bool solid, bool blank, size_t frames) {
+    struct flanterm_context *ctx = flanterm_fb_init(malloc, test_free, framebuffer, WIDTH, HEIGHT, WIDTH * 4,
+#ifdef FLANTERM_FB_SUPPORT_BPP
+                                                    8, 16, 8, 8, 8, 0,
+#endif
+#ifndef FLANTERM_FB_DISABLE_CANVAS
+                                                    canvas,
+#endif
+                                                    NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, 1, scale, scale, 0);
+    if (ctx == NULL) {
+        fprintf(stderr, "staging: out of memory\n");
+        exit(1);
+    }
+    ctx->cursor_enabled = false;
+
+    struct flanterm_flush_policy policy = { 0 };
+    flanterm_set_flush_policy(ctx, &policy);
+
+    char *buf = malloc(ctx->rows * (ctx->cols + 16) + 64);
+    if (buf == NULL) {
+        fprintf(stderr, "staging: out of memory\n");
+        exit(1);
+    }
+
+    double elapsed = 0;
+    for (size_t frame = 0; frame < frames; frame++) {
+        size_t n = make_text(ctx, buf, frame, solid);
+        flanterm_write(ctx, buf, n);
+        double start = now();
+        flanterm_flush(ctx);
+        if (!blank) {
+            elapsed += now() - start;
+            continue;
+        }
+
+        // Blank the screen again, which fills every cell in one go.
+        flanterm_write(ctx, "\x1b[2J", 4);
+        start = now();
+        flanterm_flush(ctx);
+        elapsed += now() - start;
+    }
+
+    size_t cells = ctx->rows * ctx->cols * frames;
+    printf("  scale %zu, %-6s %-5s %8.1f ns/cell\n", scale, solid ? "solid" : "canvas",
+           blank ? "blank" : "text", elapsed * 1e9 / cells);
+
+    free(buf);
+    ctx->deinit(ctx, test_free);
+}
+
+int main(int argc, char **argv) {
+    size_t frames = argc > 1 ? strtoul(argv[1], NULL, 0) : 20;
+
+    uint32_t *framebuffer = calloc(WIDTH * HEIGHT, sizeof(uint32_t));
+    uint32_t *canvas = malloc(WIDTH * HEIGHT * sizeof(uint32_t));
+    if (framebuffer == NULL || canvas == NULL) {
+        fprintf(stderr, "staging: out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < WIDTH * HEIGHT; i++) {
+        canvas[i] = (uint32_t)(i * 2654435761u) & 0x3f3f3f;
+    }
+
+#ifdef FLANTERM_FB_ENABLE_STAGING
+    printf("staging on, %zu frames at %dx%d:\n", frames, WIDTH, HEIGHT);
+#else
+    printf("staging off, %zu frames at %dx%d:\n", frames, WIDTH, HEIGHT);
+#endif
+
+    static const size_t scales[] = { 1, 2, 4 };
+    for (size_t i = 0; i < sizeof(scales) / sizeof(scales[0]); i++) {
+        run(framebuffer, canvas, scales[i], false, false, frames);
+        run(framebuffer, canvas, scales[i], true, false, frames);
+        run(framebuffer, canvas, scales[i], false, true, frames);
+    }
+
+    return 0;
+}